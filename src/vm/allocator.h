@@ -0,0 +1,59 @@
+#pragma once
+
+#include "core/vector.h"
+
+#include "vm/value.h"
+
+#include <cstddef>
+
+// Size-class pool allocator for heap objects.
+// Objects up to MaxPooledSize bytes (upvalues, closures, bound methods, instances with a few inline fields,
+// short strings, ...) are carved out of SlabSize byte slabs, with one free list per 16-byte size class.
+// Bigger objects fall back to malloc. Freed slots go back to their free list, slabs are never returned.
+// Define LOX_NO_POOL_ALLOCATOR to route everything through malloc (useful with ASan).
+
+constexpr int32_t ObjTypeCount = OBJ_ROPE + 1;
+
+const char* obj_type_name(ObjType type);
+
+struct AllocatorStats {
+    uint64_t live_count[ObjTypeCount] = {};
+    uint64_t live_bytes[ObjTypeCount] = {};
+    uint64_t total_live_bytes = 0;
+    uint64_t peak_live_bytes = 0;
+    uint64_t pooled_live_bytes = 0;     // Requested bytes currently held in slab slots
+    uint64_t slab_bytes = 0;            // Bytes reserved for slabs
+    uint64_t pool_allocations = 0;
+    uint64_t malloc_allocations = 0;
+};
+
+struct ObjAllocator {
+    static constexpr size_t SizeClassGranularity = 16;
+    static constexpr size_t MaxPooledSize = 256;
+    static constexpr size_t SizeClassCount = MaxPooledSize / SizeClassGranularity;
+    static constexpr size_t SlabSize = 64 * 1024;
+
+    AllocatorStats stats;
+
+    ~ObjAllocator();
+
+    void* allocate(ObjType type, size_t size);
+    void deallocate(ObjType type, void* ptr, size_t size);
+
+    // Share of the slab memory that isn't holding live object bytes (free slots and size class rounding).
+    double fragmentation() const;
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    static size_t size_class(size_t size) { return (size - 1) / SizeClassGranularity; }
+
+    void refill(size_t size_class);
+
+    FreeSlot* m_free_lists[SizeClassCount] = {};
+    Vector<void*> m_slabs;
+};
+
+extern ObjAllocator g_allocator;
@@ -1,17 +1,30 @@
 #include "vm/array.h"
+#include "vm/gc.h"
+#include "vm/allocator.h"
 
 ObjArray *create_obj_array() {
-    void* raw_data = malloc(sizeof(ObjArray));
+    void* raw_data = g_allocator.allocate(OBJ_ARRAY, sizeof(ObjArray));
     new (raw_data) ObjArray();
     ObjArray* array = static_cast<ObjArray*>(raw_data);
     array->init();
+    g_heap.track(&array->obj);
     return array;
 }
 
+ObjArray* copy_obj_array(const ObjArray* array) {
+    ObjArray* copy = create_obj_array();
+    copy->append(array->values, array->count);
+    for (int32_t i = 0; i < copy->count; i++) {
+        if (copy->values[i].is_obj()) copy->values[i].obj_incref();
+    }
+    return copy;
+}
+
 void free_obj_array(ObjArray *array) {
+    g_heap.untrack(&array->obj);
     array->clear();
     array->~ObjArray();
-    free(array);
+    g_allocator.deallocate(OBJ_ARRAY, array, sizeof(ObjArray));
 }
 
 static int32_t grow_capacity(int32_t capacity) {
@@ -43,6 +56,7 @@ bool ObjArray::get(int32_t index, Value *value) const {
 bool ObjArray::set(int32_t index, Value value) {
     if (index < 0) index += count;
     if (index >= count) return false;
+    if (values[index].is_obj()) values[index].obj_decref();
     values[index] = value;
     return true;
 }
@@ -69,6 +83,12 @@ void ObjArray::resize(int32_t count_) {
     count = count_;
 }
 
+void ObjArray::reserve(int32_t capacity_) {
+    if (capacity_ > capacity) {
+        adjust_capacity(this, capacity_);
+    }
+}
+
 void ObjArray::push(Value value) {
     if (count >= capacity) {
         int32_t new_capacity = grow_capacity(capacity);
@@ -82,3 +102,13 @@ bool ObjArray::pop(Value* value) {
     *value = values[--count];
     return true;
 }
+
+void ObjArray::append(const Value* values_, int32_t values_count) {
+    if (count + values_count > capacity) {
+        int32_t new_capacity = grow_capacity(capacity);
+        reserve(new_capacity > count + values_count ? new_capacity : count + values_count);
+    }
+    for (int32_t i = 0; i < values_count; i++) {
+        values[count++] = values_[i];
+    }
+}
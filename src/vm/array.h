@@ -17,11 +17,17 @@ struct ObjArray {
     bool set(int32_t index, Value value);
 
     void resize(int32_t count);
+    void reserve(int32_t capacity);
 
     void push(Value value);
+    // Appends values_count values, taking over the references to them.
+    void append(const Value* values, int32_t values_count);
     bool pop(Value* value);
 };
 
 ObjArray* create_obj_array();
 
+// A new array with the same elements as array.
+ObjArray* copy_obj_array(const ObjArray* array);
+
 void free_obj_array(ObjArray* array);
\ No newline at end of file
@@ -10,6 +10,11 @@ Chunk::~Chunk() {
             constant.obj_decref();
         }
     }
+    for (InlineCache& cache : m_inline_caches) {
+        if (cache.bound_method != nullptr) {
+            Value(cache.bound_method).obj_decref();
+        }
+    }
 }
 
 void Chunk::write(OpCode opcode, int32_t line, std::initializer_list<uint8_t> bytes) {
@@ -29,6 +34,18 @@ int32_t Chunk::add_constant(Value value) {
     return m_constants.ssize() - 1;
 }
 
+void Chunk::truncate(int32_t count) {
+    while (m_code.ssize() > count) {
+        m_code.pop_back();
+        m_lines.pop_back();
+    }
+}
+
+int32_t Chunk::add_inline_cache() {
+    m_inline_caches.push_back(InlineCache());
+    return m_inline_caches.ssize() - 1;
+}
+
 void Chunk::print_disassembly(const char *name) const {
     fmt::print("== {} ==\n", name);
     for (int32_t offset = 0; offset < m_code.ssize(); ) {
@@ -47,15 +64,18 @@ int32_t Chunk::disassemble_instruction(int32_t offset) const {
     uint8_t instr = m_code[offset];
     switch (instr) {
         case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return print_constant_instruction((OpCode)instr, offset);
         case OP_GET_GLOBAL:
         case OP_DEFINE_GLOBAL:
         case OP_SET_GLOBAL:
-        case OP_CLASS:
-        case OP_METHOD:
+            return print_global_instruction((OpCode)instr, offset);
         case OP_GET_PROPERTY:
         case OP_SET_PROPERTY:
-        case OP_GET_SUPER:
-            return print_constant_instruction((OpCode)instr, offset);
+            return print_property_instruction((OpCode)instr, offset);
         case OP_NIL:
         case OP_TRUE:
         case OP_FALSE:
@@ -78,6 +98,21 @@ int32_t Chunk::disassemble_instruction(int32_t offset) const {
         case OP_SET_NOPOP:
         case OP_CLOSE_UPVALUE:
         case OP_INHERIT:
+        case OP_ADD_INT:
+        case OP_SUBTRACT_INT:
+        case OP_MULTIPLY_INT:
+        case OP_GREATER_INT:
+        case OP_GREATER_EQUAL_INT:
+        case OP_LESS_INT:
+        case OP_LESS_EQUAL_INT:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
             return print_simple_instruction((OpCode)instr, offset);
         case OP_GET_LOCAL:
         case OP_SET_LOCAL:
@@ -89,8 +124,8 @@ int32_t Chunk::disassemble_instruction(int32_t offset) const {
         case OP_SUPER_INVOKE:
             return print_invoke_instruction((OpCode)instr, offset);
         case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = m_code[offset++];
+            int32_t constant = read_operand(offset + 1, 3);
+            offset += 4;
             fmt::print("{:<16s} {:4d} ", "OP_CLOSURE", constant);
             fmt::print(m_constants[constant].to_std_string());
             fmt::print("\n");
@@ -105,30 +140,142 @@ int32_t Chunk::disassemble_instruction(int32_t offset) const {
         }
         case OP_JUMP:
         case OP_JUMP_IF_FALSE:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
             return print_jump_instruction((OpCode)instr, 1, offset);
         case OP_LOOP:
+        case OP_LOOP_LONG:
             return print_jump_instruction((OpCode)instr, -1, offset);
         case OP_ARRAY_NEW:
-        case OP_TABLE_NEW:
             return print_object_new_instruction((OpCode)instr, offset);
+        case OP_ARRAY_COPY: {
+            int32_t constant = read_operand(offset + 1, 3);
+            fmt::print("{:<16s} {:4d} ", "OP_ARRAY_COPY", constant);
+            fputs(m_constants[constant].to_std_string().c_str(), stdout);
+            fputs("\n", stdout);
+            return offset + 4;
+        }
+        case OP_ARRAY_APPEND:
+            return print_byte_instruction((OpCode)instr, offset);
+        case OP_TABLE_NEW:
+            return print_simple_instruction((OpCode)instr, offset);
+        case OP_TABLE_BUILD: {
+            int32_t constant = read_operand(offset + 1, 3);
+            fmt::print("{:<16s} {:4d} values {:4d} ", "OP_TABLE_BUILD", constant, m_code[offset + 4]);
+            fputs(m_constants[constant].to_std_string().c_str(), stdout);
+            fputs("\n", stdout);
+            return offset + 5;
+        }
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_LESS_LOCAL_CONST_JUMP:
+        case OP_GET_THIS_PROPERTY:
+            return print_super_instruction((OpCode)instr, offset);
+        case OP_R_MOVE:
+            return print_register_instruction((OpCode)instr, 2, offset);
+        case OP_R_EQUAL:
+        case OP_R_NOT_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_GREATER_EQUAL:
+        case OP_R_LESS:
+        case OP_R_LESS_EQUAL:
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+            return print_register_instruction((OpCode)instr, 3, offset);
         default:
             return print_simple_instruction(OP_INVALID, offset);
     }
 }
 
+int32_t Chunk::jump_target(int32_t offset) const {
+    uint8_t instr = m_code[offset];
+    int32_t width = is_long_jump(instr) ? 3 : 2;
+    int32_t end = offset + 1 + width;
+    int32_t jump = read_operand(offset + 1, width);
+    return instr == OP_LOOP || instr == OP_LOOP_LONG ? end - jump : end + jump;
+}
+
+int32_t Chunk::instruction_length(int32_t offset) const {
+    switch (m_code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_ARRAY_APPEND:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_R_MOVE:
+        case OP_ADD_LOCAL_LOCAL:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_ARRAY_NEW:
+        case OP_ARRAY_COPY:
+        case OP_R_EQUAL:
+        case OP_R_NOT_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_GREATER_EQUAL:
+        case OP_R_LESS:
+        case OP_R_LESS_EQUAL:
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+            return 4;
+        case OP_SUPER_INVOKE:
+        case OP_TABLE_BUILD:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return 5;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+            return 6;
+        case OP_INVOKE:
+            return 7;
+        case OP_CLOSURE: {
+            ObjFunction* function = m_constants[read_operand(offset + 1, 3)].as_function();
+            return 4 + 2 * function->upvalue_count;
+        }
+        default:
+            return 1;
+    }
+}
+
 int32_t Chunk::print_simple_instruction(OpCode opcode, int32_t offset) const {
     assert(opcode < OP_COUNT);
     fmt::print("{}\n", g_opcode_str[opcode]);
     return offset + 1;
 }
 
+int32_t Chunk::read_operand(int32_t offset, int32_t width) const {
+    int32_t operand = 0;
+    for (int32_t i = 0; i < width; i++) {
+        operand = (operand << 8) | m_code[offset + i];
+    }
+    return operand;
+}
+
 int32_t Chunk::print_constant_instruction(OpCode opcode, int32_t offset) const {
     assert(opcode < OP_COUNT);
-    uint8_t constant_loc = m_code[offset + 1];
+    int32_t width = opcode == OP_CONSTANT ? 1 : 3;
+    int32_t constant_loc = read_operand(offset + 1, width);
     fmt::print("{:<16s} {:4d} '", g_opcode_str[opcode], constant_loc);
     fputs(m_constants[constant_loc].to_std_string().c_str(), stdout);
     fputs("'\n", stdout);
-    return offset + 2;
+    return offset + 1 + width;
 }
 
 int32_t Chunk::print_byte_instruction(OpCode opcode, int32_t offset) const {
@@ -138,29 +285,93 @@ int32_t Chunk::print_byte_instruction(OpCode opcode, int32_t offset) const {
     return offset + 2;
 }
 
+int32_t Chunk::print_global_instruction(OpCode opcode, int32_t offset) const {
+    assert(opcode < OP_COUNT);
+    uint16_t slot = (uint16_t)(m_code[offset + 1] << 8);
+    slot |= m_code[offset + 2];
+    fmt::print("{:<16s} {:4d}\n", g_opcode_str[opcode], slot);
+    return offset + 3;
+}
+
+int32_t Chunk::print_property_instruction(OpCode opcode, int32_t offset) const {
+    assert(opcode < OP_COUNT);
+    int32_t constant_loc = read_operand(offset + 1, 3);
+    int32_t cache = read_operand(offset + 4, 2);
+    fmt::print("{:<16s} {:4d} '", g_opcode_str[opcode], constant_loc);
+    fputs(m_constants[constant_loc].to_std_string().c_str(), stdout);
+    fmt::print("' ic {}\n", cache);
+    return offset + 6;
+}
+
 int32_t Chunk::print_invoke_instruction(OpCode opcode, int32_t offset) const {
     assert(opcode < OP_COUNT);
-    uint8_t constant = m_code[offset + 1];
-    uint8_t arg_count = m_code[offset + 2];
+    int32_t constant = read_operand(offset + 1, 3);
+    uint8_t arg_count = m_code[offset + 4];
     fmt::print("{:<16s} {:4d} args {:4d} '", g_opcode_str[opcode], arg_count, constant);
     fputs(m_constants[constant].to_std_string().c_str(), stdout);
+    if (opcode == OP_INVOKE) {
+        int32_t cache = read_operand(offset + 5, 2);
+        fmt::print("' ic {}\n", cache);
+        return offset + 7;
+    }
     fputs("'\n", stdout);
-    return offset + 3;
+    return offset + 5;
 }
 
 int32_t Chunk::print_jump_instruction(OpCode opcode, int32_t sign, int32_t offset) const {
     assert(opcode < OP_COUNT);
-    uint16_t jump = (uint16_t)(m_code[offset + 1] << 8);
-    jump |= m_code[offset + 2];
-    fmt::print("{:<16s} {:4d} -> {:d}\n", g_opcode_str[opcode], offset, offset + 3 + sign * jump);
-    return offset + 3;
+    bool is_long = opcode == OP_JUMP_LONG || opcode == OP_JUMP_IF_FALSE_LONG || opcode == OP_LOOP_LONG;
+    int32_t width = is_long ? 3 : 2;
+    int32_t jump = read_operand(offset + 1, width);
+    int32_t end = offset + 1 + width;
+    fmt::print("{:<16s} {:4d} -> {:d}\n", g_opcode_str[opcode], offset, end + sign * jump);
+    return end;
 }
 
 int32_t Chunk::print_object_new_instruction(OpCode opcode, int32_t offset) const {
-    uint16_t count = (uint16_t)(m_code[offset + 1] << 8);
-    count |= m_code[offset + 2];
+    int32_t count = read_operand(offset + 1, 3);
     fmt::print("{:<16s} {:4d}\n", g_opcode_str[opcode], count);
-    return offset + 3;
+    return offset + 4;
+}
+
+int32_t Chunk::print_register_instruction(OpCode opcode, int32_t operand_count, int32_t offset) const {
+    assert(opcode < OP_COUNT);
+    fmt::print("{:<16s} {} <-", g_opcode_str[opcode], register_operand_str(m_code[offset + 1], false));
+    for (int32_t i = 2; i <= operand_count; i++) {
+        fmt::print(" {}", register_operand_str(m_code[offset + i], true));
+    }
+    fmt::print("\n");
+    return offset + 1 + operand_count;
 }
 
+std::string Chunk::register_operand_str(uint8_t operand, bool is_rk) const {
+    if (!is_rk && operand == RegisterPush) {
+        return "push";
+    }
+    if (is_rk && (operand & RKConstantBit)) {
+        return fmt::format("k{}'{}'", operand & ~RKConstantBit, m_constants[operand & ~RKConstantBit].to_std_string());
+    }
+    return fmt::format("r{}", operand);
+}
 
+int32_t Chunk::print_super_instruction(OpCode opcode, int32_t offset) const {
+    assert(opcode < OP_COUNT);
+    switch (opcode) {
+        case OP_ADD_LOCAL_LOCAL:
+            fmt::print("{:<16s} {:4d} {:4d}\n", g_opcode_str[opcode], m_code[offset + 1], m_code[offset + 2]);
+            return offset + 3;
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            uint8_t constant = m_code[offset + 2];
+            uint16_t jump = (uint16_t)(m_code[offset + 3] << 8);
+            jump |= m_code[offset + 4];
+            fmt::print("{:<16s} {:4d} '", g_opcode_str[opcode], m_code[offset + 1]);
+            fputs(m_constants[constant].to_std_string().c_str(), stdout);
+            fmt::print("' -> {:d}\n", offset + 5 + jump);
+            return offset + 5;
+        }
+        case OP_GET_THIS_PROPERTY:
+            return print_property_instruction(opcode, offset);
+        default:
+            return print_simple_instruction(OP_INVALID, offset);
+    }
+}
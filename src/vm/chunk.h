@@ -8,12 +8,68 @@
 #include "vm/string.h"
 
 #include <cassert>
+#include <string>
+
+struct ObjClosure;
+struct ObjBoundMethod;
+struct Shape;
+
+static constexpr int32_t InlineCacheSize = 4;
+
+// One receiver shape seen by a property access / invoke site.
+struct InlineCacheEntry {
+    uint32_t shape_id;
+    int32_t field_index;  // slot of the field on instances of this shape, or -1 if the name isn't a field
+    ObjClosure* method;   // method the name resolves to when it isn't a field
+    Shape* transition;    // for OP_SET_PROPERTY adding a new field: the shape after adding it
+};
+
+// Polymorphic inline cache for a single OP_GET_PROPERTY / OP_SET_PROPERTY / OP_INVOKE.
+struct InlineCache {
+    InlineCacheEntry entries[InlineCacheSize] = {};
+    int32_t count = 0;
+    int32_t next_evict = 0;
+    // Last bound method created by an OP_GET_PROPERTY site (owns a reference).
+    // Rebound in place once the cache holds the only reference, see VM::bind_method().
+    ObjBoundMethod* bound_method = nullptr;
+
+    InlineCacheEntry* find(uint32_t shape_id) {
+        for (int32_t i = 0; i < count; i++) {
+            if (entries[i].shape_id == shape_id) return &entries[i];
+        }
+        return nullptr;
+    }
+
+    void update(uint32_t shape_id, int32_t field_index, ObjClosure* method, Shape* transition = nullptr) {
+        InlineCacheEntry* entry = find(shape_id);
+        if (entry == nullptr) {
+            if (count < InlineCacheSize) {
+                entry = &entries[count++];
+            }
+            else {
+                // Megamorphic site, just cycle through the slots.
+                entry = &entries[next_evict];
+                next_evict = (next_evict + 1) % InlineCacheSize;
+            }
+        }
+        entry->shape_id = shape_id;
+        entry->field_index = field_index;
+        entry->method = method;
+        entry->transition = transition;
+    }
+};
 
 class Chunk {
 public:
     Vector<uint8_t> m_code;
     Vector<int32_t> m_lines;
     Vector<Value> m_constants;
+    Vector<InlineCache> m_inline_caches;
+
+    // Quickening counters (see VM::run()): instructions rewritten to a type-specialized opcode, and specialized
+    // instructions rewritten back because their operands had another type.
+    int32_t m_quickenings = 0;
+    int32_t m_deopts = 0;
 
     Chunk() = default;
     ~Chunk();
@@ -25,20 +81,44 @@ public:
 
     int32_t add_constant(Value value);
 
+    // Drops the code after count bytes, used by the compiler to rewrite the instructions it just emitted.
+    void truncate(int32_t count);
+
+    int32_t add_inline_cache();
+
     void print_disassembly(const char* name) const;
 
     int32_t disassemble_instruction(int32_t offset) const;
 
+    // Size in bytes of the instruction at offset, including its operands.
+    int32_t instruction_length(int32_t offset) const;
+
+    // Offset that the jump at offset (see is_jump()) lands on.
+    int32_t jump_target(int32_t offset) const;
+
 private:
+    // Big-endian operand of width bytes at offset.
+    int32_t read_operand(int32_t offset, int32_t width) const;
+
     int32_t print_simple_instruction(OpCode opcode, int32_t offset) const;
 
     int32_t print_constant_instruction(OpCode opcode, int32_t offset) const;
 
     int32_t print_byte_instruction(OpCode opcode, int32_t offset) const;
 
+    int32_t print_global_instruction(OpCode opcode, int32_t offset) const;
+
+    int32_t print_property_instruction(OpCode opcode, int32_t offset) const;
+
     int32_t print_invoke_instruction(OpCode opcode, int32_t offset) const;
 
     int32_t print_jump_instruction(OpCode opcode, int32_t sign, int32_t offset) const;
 
+    int32_t print_register_instruction(OpCode opcode, int32_t operand_count, int32_t offset) const;
+
+    int32_t print_super_instruction(OpCode opcode, int32_t offset) const;
+
+    std::string register_operand_str(uint8_t operand, bool is_rk) const;
+
     int32_t print_object_new_instruction(OpCode opcode, int32_t offset) const;
 };
@@ -4,7 +4,11 @@
 #include "vm/parser.h"
 #include "vm/string_interner.h"
 #include "vm/table.h"
+#include "vm/globals.h"
+#include "vm/array.h"
+#include "vm/string.h"
 #include "vm/object.h"
+#include "vm/optimizer.h"
 
 #include "core/array.h"
 
@@ -58,6 +62,28 @@ struct Upvalue {
     bool is_local;
 };
 
+// A GET_LOCAL or CONSTANT that the register backend can fold into a register instruction as an RK operand.
+struct OperandLoad {
+    int32_t start = -1;
+    int32_t end = -1;
+    uint8_t rk = 0;
+};
+
+// Totals over everything a VM has compiled, for --stats.
+struct CompilerStats {
+    uint64_t folded_expressions = 0; // Operators evaluated at compile time
+    uint64_t dead_branches = 0;      // Constant conditions whose untaken branch was dropped
+    uint64_t emitted_bytes = 0;      // Bytecode emitted, after folding but before optimize_chunk()
+    uint64_t code_bytes = 0;         // Bytecode after optimize_chunk()
+    uint64_t folded_bytes = 0;       // Bytecode that folding emitted and then removed
+    OptimizerStats optimizer;
+};
+
+struct CompilerOptions {
+    bool register_ops = false; // Emit OP_R_* instructions, see Backend
+    OptLevel opt_level = OptLevel::O1;
+};
+
 #define MEMBER_FN(object,ptrToMember)  ((object).*(ptrToMember))
 
 struct ClassCompiler {
@@ -72,8 +98,10 @@ struct ClassCompiler {
 
 class Compiler {
 public:
-    Compiler(Parser* parser, StringInterner* string_interner)
-    : m_parser(parser), m_string_interner(string_interner) {}
+    Compiler(Parser* parser, StringInterner* string_interner, GlobalTable* globals, CompilerStats* stats,
+             const CompilerOptions& options)
+    : m_parser(parser), m_string_interner(string_interner), m_globals(globals), m_register_ops(options.register_ops),
+      m_stats(stats), m_options(options) {}
 
     void init_script() {
         m_function = create_obj_function();
@@ -120,8 +148,8 @@ public:
                 if (m_function->arity > 255) {
                     m_parser->error_at_current("Can't have more than 255 parameters.");
                 }
-                uint8_t constant = parse_variable("Expect parameter name.");
-                define_variable(constant);
+                int32_t global = parse_variable("Expect parameter name.");
+                define_variable(global);
             } while (m_parser->match(TOKEN_COMMA));
         }
         m_parser->consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -155,42 +183,165 @@ public:
         emit_byte(byte2);
     }
 
-    void emit_loop(int32_t loop_start) {
-        emit_byte(OP_LOOP);
+    void emit_short(uint16_t value) {
+        emit_byte((value >> 8) & 0xff);
+        emit_byte(value & 0xff);
+    }
 
-        int32_t offset = current_chunk()->code_count() - loop_start + 2;
-        if (offset > UINT16_MAX) m_parser->error("Loop body too large.");
+    void emit_long(int32_t value) {
+        emit_byte((value >> 16) & 0xff);
+        emit_byte((value >> 8) & 0xff);
+        emit_byte(value & 0xff);
+    }
 
-        emit_byte((offset >> 8) & 0xff);
-        emit_byte(offset & 0xff);
+    // The offset counts from the end of the loop instruction, which is a byte longer in the _LONG form.
+    void emit_loop(int32_t loop_start) {
+        int32_t offset = current_chunk()->code_count() + 3 - loop_start;
+        if (offset <= UINT16_MAX) {
+            emit_byte(OP_LOOP);
+            emit_short((uint16_t)offset);
+            return;
+        }
+        offset++;
+        if (offset > MaxJump) m_parser->error("Loop body too large.");
+        emit_byte(OP_LOOP_LONG);
+        emit_long(offset);
     }
 
+    // Forward jumps are emitted in the _LONG form since their distance isn't known yet, peephole_optimize()
+    // shortens the ones that fit in 16 bits. instruction is OP_JUMP or OP_JUMP_IF_FALSE.
     int32_t emit_jump(uint8_t instruction) {
-        emit_byte(instruction);
-        emit_byte(0xff);
-        emit_byte(0xff);
-        return current_chunk()->m_code.ssize() - 2;
+        emit_byte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+        emit_long(MaxJump);
+        return current_chunk()->m_code.ssize() - 3;
     }
 
     void patch_jump(int32_t offset) {
-        int32_t jump = current_chunk()->m_code.ssize() - offset - 2;
-        if (jump > UINT16_MAX) {
+        int32_t jump = current_chunk()->m_code.ssize() - offset - 3;
+        if (jump > MaxJump) {
             m_parser->error("Too much code to jump over.");
         }
-        current_chunk()->m_code[offset] = (jump >> 8) & 0xff;
-        current_chunk()->m_code[offset + 1] = jump & 0xff;
+        current_chunk()->m_code[offset] = (jump >> 16) & 0xff;
+        current_chunk()->m_code[offset + 1] = (jump >> 8) & 0xff;
+        current_chunk()->m_code[offset + 2] = jump & 0xff;
+        m_last_jump_target = current_chunk()->code_count();
     }
 
     int32_t emit_array_new() {
         emit_byte(OP_ARRAY_NEW);
-        emit_byte(0xff);
-        emit_byte(0xff);
-        return current_chunk()->m_code.ssize() - 2;
-    }
-
-    void patch_array_new(int32_t offset, int16_t count) {
-        current_chunk()->m_code[offset] = (count >> 8) & 0xff;
-        current_chunk()->m_code[offset + 1] = count & 0xff;
+        emit_long(0);
+        return current_chunk()->m_code.ssize() - 3;
+    }
+
+    // Sets the capacity operand of OP_ARRAY_NEW, or the template constant if it was turned into OP_ARRAY_COPY.
+    void patch_array_new(int32_t offset, int32_t operand) {
+        current_chunk()->m_code[offset] = (operand >> 16) & 0xff;
+        current_chunk()->m_code[offset + 1] = (operand >> 8) & 0xff;
+        current_chunk()->m_code[offset + 2] = operand & 0xff;
+    }
+
+    // If the instruction at offset pushes a constant (OP_NIL, OP_TRUE, OP_FALSE, OP_CONSTANT or OP_CONSTANT_LONG),
+    // returns its length along with the constant and its index in the pool (-1 for the first three). Returns 0 otherwise,
+    // including when offset is the end of the code (an expression that failed to parse emits nothing).
+    int32_t decode_constant(int32_t offset, Value* value, int32_t* index) const {
+        const Chunk* chunk = current_chunk();
+        *index = -1;
+        if (offset >= chunk->code_count()) return 0;
+        uint8_t instr = chunk->m_code[offset];
+        switch (instr) {
+            case OP_NIL: *value = Value(); return 1;
+            case OP_TRUE: *value = Value(true); return 1;
+            case OP_FALSE: *value = Value(false); return 1;
+            case OP_CONSTANT:
+                *index = chunk->m_code[offset + 1];
+                *value = chunk->m_constants[*index];
+                return 2;
+            case OP_CONSTANT_LONG:
+                *index = (chunk->m_code[offset + 1] << 16) | (chunk->m_code[offset + 2] << 8) | chunk->m_code[offset + 3];
+                *value = chunk->m_constants[*index];
+                return 4;
+            default: return 0;
+        }
+    }
+
+    // If all the code emitted since start does is push a constant, removes that code and returns the constant.
+    // A constant from the pool is removed from it too, and the caller takes over its reference.
+    bool take_constant(int32_t start, Value* value) {
+        Chunk* chunk = current_chunk();
+        int32_t index;
+        if (start >= chunk->code_count() ||
+            decode_constant(start, value, &index) != chunk->code_count() - start ||
+            (index >= 0 && index != chunk->m_constants.ssize() - 1)) {
+            return false;
+        }
+        if (index >= 0) chunk->m_constants.pop_back();
+        chunk->truncate(start);
+        m_last_load = OperandLoad();
+        m_last_constant = -1;
+        return true;
+    }
+
+    // Constant folding: operators and conditions whose operands the code emitted so far ends with as constant pushes
+    // are evaluated here, and their code replaced with the result or the branch that's taken.
+
+    // The offset of the constant push that the code emitted so far ends with, if nothing can jump into the middle
+    // of it, or -1. An expression whose code ends with a constant push is that constant.
+    int32_t trailing_constant() const {
+        if (m_options.opt_level == OptLevel::O0 || m_last_constant < m_last_jump_target) return -1;
+        Value value;
+        int32_t index;
+        if (m_last_constant + decode_constant(m_last_constant, &value, &index) != current_chunk()->code_count()) {
+            return -1;
+        }
+        return m_last_constant;
+    }
+
+    // Removes the code emitted from start on, which nothing after it jumps into.
+    void discard_code(int32_t start) {
+        m_stats->folded_bytes += current_chunk()->code_count() - start;
+        current_chunk()->truncate(start);
+        if (m_last_load.end > start) m_last_load = OperandLoad();
+        if (m_last_register_op >= start) m_last_register_op = -1;
+        if (m_last_set_local >= start) m_last_set_local = -1;
+        if (m_last_constant >= start) m_last_constant = -1;
+        if (m_last_jump_target > start) m_last_jump_target = start;
+    }
+
+    // Removes the constant push at start (the last code emitted), along with its pool entry unless other constants
+    // were added after it.
+    void discard_constant(int32_t start) {
+        Chunk* chunk = current_chunk();
+        Value value;
+        int32_t index;
+        decode_constant(start, &value, &index);
+        if (index >= 0 && index == chunk->m_constants.ssize() - 1) {
+            chunk->m_constants.pop_back();
+            if (value.is_obj()) value.obj_decref();
+        }
+        discard_code(start);
+    }
+
+    // Replaces the operands of a folded operator, constant pushes from operand_start on, with a push of its result.
+    // Takes over the reference to result.
+    void emit_folded(int32_t operand_start, int32_t right_start, Value result) {
+        if (right_start >= 0) discard_constant(right_start);
+        discard_constant(operand_start);
+        int32_t start = current_chunk()->code_count();
+        if (result.is_nil()) emit_byte(OP_NIL);
+        else if (result.is_bool()) emit_byte(result.as_bool() ? OP_TRUE : OP_FALSE);
+        else emit_constant(result);
+        m_last_constant = start;
+        m_stats->folded_expressions++;
+        m_stats->folded_bytes -= current_chunk()->code_count() - start; // The result replaces the operands
+    }
+
+    void emit_inline_cache() {
+        int32_t cache = current_chunk()->add_inline_cache();
+        if (cache > UINT16_MAX) {
+            m_parser->error("Too many property accesses in one chunk.");
+            cache = 0;
+        }
+        emit_short((uint16_t)cache);
     }
 
     void emit_return() {
@@ -204,21 +355,101 @@ public:
         emit_byte(OP_RETURN);
     }
 
-    uint8_t make_constant(Value value) {
+    int32_t make_constant(Value value) {
         int32_t constant = current_chunk()->add_constant(value);
-        if (constant > UINT8_MAX) {
+        if (constant >= MaxConstants) {
             m_parser->error("Too many constants in one chunk.");
             return 0;
         }
-        return (uint8_t) constant;
+        return constant;
     }
 
     void emit_constant(Value value) {
-        emit_bytes(OP_CONSTANT, make_constant(value));
+        int32_t start = current_chunk()->code_count();
+        int32_t constant = make_constant(value);
+        if (constant <= UINT8_MAX) {
+            emit_bytes(OP_CONSTANT, (uint8_t)constant);
+        }
+        else {
+            emit_byte(OP_CONSTANT_LONG);
+            emit_long(constant);
+        }
+        m_last_constant = start;
+        if (constant < RKConstantBit) {
+            m_last_load = {start, start + 2, (uint8_t)(constant | RKConstantBit)};
+        }
+    }
+
+    // The operand load that the code emitted so far ends with, if nothing can jump into the middle of it.
+    OperandLoad trailing_operand_load() const {
+        if (!m_register_ops ||
+            m_last_load.end != current_chunk()->code_count() ||
+            m_last_load.start < m_last_jump_target) {
+            return OperandLoad();
+        }
+        return m_last_load;
+    }
+
+    // Replaces `left right OP_<binary op>` (both plain operand loads) with one OP_R_<binary op> pushing the result.
+    bool emit_register_binary(TokenType op_type, OperandLoad left, OperandLoad right) {
+        uint8_t op;
+        switch (op_type) {
+            case TOKEN_BANG_EQUAL:    op = OP_R_NOT_EQUAL; break;
+            case TOKEN_EQUAL_EQUAL:   op = OP_R_EQUAL; break;
+            case TOKEN_GREATER:       op = OP_R_GREATER; break;
+            case TOKEN_GREATER_EQUAL: op = OP_R_GREATER_EQUAL; break;
+            case TOKEN_LESS:          op = OP_R_LESS; break;
+            case TOKEN_LESS_EQUAL:    op = OP_R_LESS_EQUAL; break;
+            case TOKEN_PLUS:          op = OP_R_ADD; break;
+            case TOKEN_MINUS:         op = OP_R_SUBTRACT; break;
+            case TOKEN_STAR:          op = OP_R_MULTIPLY; break;
+            case TOKEN_SLASH:         op = OP_R_DIVIDE; break;
+            default: return false;
+        }
+        current_chunk()->truncate(left.start);
+        m_last_load = OperandLoad();
+        m_last_constant = -1;
+        m_last_register_op = current_chunk()->code_count();
+        emit_bytes(op, RegisterPush);
+        emit_bytes(left.rk, right.rk);
+        return true;
+    }
+
+    // Pops the value of an expression statement. With the register backend, an assignment to a local
+    // whose right-hand side is a register instruction or a plain operand load writes the local directly
+    // instead of going through the stack.
+    void emit_expression_pop() {
+        int32_t set = m_last_set_local;
+        if (m_register_ops && set >= 0 &&
+            set + 2 == current_chunk()->code_count() && m_last_jump_target <= set) {
+            uint8_t slot = current_chunk()->m_code[set + 1];
+            if (slot != RegisterPush &&
+                m_last_register_op >= m_last_jump_target && m_last_register_op + 4 == set &&
+                current_chunk()->m_code[m_last_register_op + 1] == RegisterPush) {
+                current_chunk()->truncate(set);
+                current_chunk()->m_code[m_last_register_op + 1] = slot;
+                m_last_register_op = -1;
+                return;
+            }
+            if (slot != RegisterPush &&
+                m_last_load.end == set && m_last_load.start >= m_last_jump_target) {
+                uint8_t rk = m_last_load.rk;
+                current_chunk()->truncate(m_last_load.start);
+                m_last_load = OperandLoad();
+                m_last_constant = -1;
+                emit_bytes(OP_R_MOVE, slot);
+                emit_byte(rk);
+                return;
+            }
+        }
+        emit_byte(OP_POP);
     }
 
     ObjFunction* end() {
         emit_return();
+        m_stats->emitted_bytes += current_chunk()->code_count();
+        optimize_chunk(current_chunk(), m_options.opt_level, &m_stats->optimizer);
+        m_stats->code_bytes += current_chunk()->code_count();
         ObjFunction* function = m_function;
 #ifdef DEBUG_PRINT_CODE
         if (!m_parser->had_error()) {
@@ -261,10 +492,11 @@ public:
     }
 
     void function(FunctionType type) {
-        Compiler compiler(m_parser, m_string_interner);
+        Compiler compiler(m_parser, m_string_interner, m_globals, m_stats, m_options);
         ObjFunction* function = compiler.compile_function(this, type);
         Value val_fn = Value(function);
-        emit_bytes(OP_CLOSURE, make_constant(val_fn));
+        emit_byte(OP_CLOSURE);
+        emit_long(make_constant(val_fn));
 
         for (int32_t i = 0; i < function->upvalue_count; i++) {
             emit_byte(compiler.m_upvalues[i].is_local ? 1 : 0);
@@ -274,7 +506,7 @@ public:
 
     void method() {
         m_parser->consume(TOKEN_IDENTIFIER, "Expect method name.");
-        uint8_t constant = identifier_constant(m_parser->previous());
+        int32_t constant = identifier_constant(m_parser->previous());
 
         FunctionType type = FunctionType::Method;
         if (m_parser->previous().length == 4 &&
@@ -282,17 +514,20 @@ public:
             type = FunctionType::Initializer;
         }
         function(type);
-        emit_bytes(OP_METHOD, constant);
+        emit_byte(OP_METHOD);
+        emit_long(constant);
     }
 
     void class_declaration() {
         m_parser->consume(TOKEN_IDENTIFIER, "Expect class name.");
         Token class_name = m_parser->previous();
-        uint8_t name_constant = identifier_constant(class_name);
+        int32_t name_constant = identifier_constant(class_name);
         declare_variable();
+        int32_t global = m_scope_depth > 0 ? 0 : global_slot(class_name);
 
-        emit_bytes(OP_CLASS, name_constant);
-        define_variable(name_constant);
+        emit_byte(OP_CLASS);
+        emit_long(name_constant);
+        define_variable(global);
 
         ClassCompiler class_compiler;
         class_compiler.init(m_class_compiler);
@@ -330,14 +565,14 @@ public:
     }
 
     void fun_declaration() {
-        uint8_t global = parse_variable("Expect function name.");
+        int32_t global = parse_variable("Expect function name.");
         mark_initialized();
         function(FunctionType::Function);
         define_variable(global);
     }
 
     void var_declaration() {
-        uint8_t global = parse_variable("Expect variable name.");
+        int32_t global = parse_variable("Expect variable name.");
         if (m_parser->match(TOKEN_EQUAL)) {
             expression();
         }
@@ -368,7 +603,7 @@ public:
     void expression_statement() {
         expression();
         m_parser->consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-        emit_byte(OP_POP);
+        emit_expression_pop();
     }
 
     void for_statement() {
@@ -400,7 +635,7 @@ public:
             int32_t body_jump = emit_jump(OP_JUMP);
             int32_t increment_start = current_chunk()->code_count();
             expression(); // increment expression
-            emit_byte(OP_POP);
+            emit_expression_pop();
             m_parser->consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
             emit_loop(loop_start);
@@ -421,9 +656,28 @@ public:
 
     void if_statement() {
         m_parser->consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+        int32_t condition_start = current_chunk()->code_count();
         expression();
         m_parser->consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+        if (trailing_constant() == condition_start) {
+            Value condition;
+            int32_t index;
+            decode_constant(condition_start, &condition, &index);
+            bool taken = !condition.is_falsey();
+            discard_constant(condition_start);
+            int32_t start = current_chunk()->code_count();
+            statement();
+            if (!taken) discard_code(start);
+            if (m_parser->match(TOKEN_ELSE)) {
+                start = current_chunk()->code_count();
+                statement();
+                if (taken) discard_code(start);
+            }
+            m_stats->dead_branches++;
+            return;
+        }
+
         int32_t then_jump = emit_jump(OP_JUMP_IF_FALSE);
         emit_byte(OP_POP);
         statement();
@@ -443,6 +697,20 @@ public:
         expression();
         m_parser->consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+        // A constant condition either skips the loop entirely or never exits it.
+        if (trailing_constant() == loop_start) {
+            Value condition;
+            int32_t index;
+            decode_constant(loop_start, &condition, &index);
+            bool taken = !condition.is_falsey();
+            discard_constant(loop_start);
+            statement();
+            if (!taken) discard_code(loop_start);
+            else emit_loop(loop_start);
+            m_stats->dead_branches++;
+            return;
+        }
+
         int32_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
         emit_byte(OP_POP);
         statement();
@@ -499,50 +767,103 @@ public:
 
     void number(bool can_assign) {
         double value = strtod(m_parser->previous().start, nullptr);
-        emit_constant(Value(value));
+        emit_constant(Value::number(value));
     }
 
     void string(bool can_assign) {
-        ObjString* str = m_string_interner->create_string(m_parser->previous().start + 1, m_parser->previous().length - 2);
-        auto value = Value(str);
-        value.obj_incref();
+        Value value = m_string_interner->create_string_value(m_parser->previous().start + 1, m_parser->previous().length - 2);
+        if (value.is_obj()) value.obj_incref();
         emit_constant(value);
     }
 
+    // The values of the first TableBuildMax keys are pushed and OP_TABLE_BUILD makes the table from a layout table
+    // in the constant pool that maps each key to the index of its value, so every table this literal creates copies
+    // the same precomputed slots. The layout has room for all the keys, the ones after that are set one by one
+    // without growing the table.
     void table(bool can_assign) {
-        emit_byte(OP_TABLE_NEW);
+        if (m_parser->match(TOKEN_RIGHT_BRACE)) {
+            emit_byte(OP_TABLE_NEW);
+            return;
+        }
 
+        ObjTable* layout = create_obj_table();
+        int32_t count = 0;
         while (m_parser->match(TOKEN_IDENTIFIER)) {
-            ObjString* str = m_string_interner->create_string(m_parser->previous().start, m_parser->previous().length);
-            auto key = Value(str);
-            key.obj_incref();
-            emit_constant(key);
+            // The key is a string value like any other, not a name
+            Value key = m_string_interner->create_string_value(m_parser->previous().start, m_parser->previous().length);
+            if (key.is_obj()) key.obj_incref();
+            if (count < TableBuildMax) {
+                if (!layout->set(key, Value::integer(count)) && key.is_obj()) key.obj_decref();
+            }
+            else {
+                emit_constant(key);
+            }
 
             m_parser->consume(TOKEN_EQUAL, "Expect '=' after identifier in table initializer list.");
 
             expression();
 
-            emit_byte(OP_SET_NOPOP);
+            count++;
+            if (count > TableBuildMax) {
+                emit_byte(OP_SET_NOPOP);
+            }
+            if (count == TableBuildMax) {
+                emit_table_build(layout, count);
+            }
 
             if (!m_parser->match(TOKEN_COMMA)) break;
         }
+        if (count < TableBuildMax) {
+            emit_table_build(layout, count);
+        }
+        layout->reserve(count);
 
         m_parser->consume(TOKEN_RIGHT_BRACE, "Expect '}' after table initializer list.");
     }
 
+    void emit_table_build(ObjTable* layout, int32_t value_count) {
+        int32_t constant = make_constant(Value(layout));
+        emit_byte(OP_TABLE_BUILD);
+        emit_long(constant);
+        emit_byte((uint8_t)value_count);
+    }
+
+    // The leading elements that are constants go into a template array in the constant pool, and the
+    // OP_ARRAY_NEW is patched into an OP_ARRAY_COPY of it. The elements after the first non-constant one are
+    // left on the stack and moved into the array by an OP_ARRAY_APPEND every ArrayAppendMax elements.
     void array(bool can_assign) {
-        int32_t array_size_offset = emit_array_new();
+        int32_t array_new_offset = emit_array_new();
 
-        int32_t index = 0;
+        Vector<Value> constants;
+        int32_t count = 0;
+        int32_t pending = 0;
         while (true) {
-            emit_constant(Value((double)index));
+            int32_t start = current_chunk()->code_count();
             expression();
-            emit_byte(OP_SET_NOPOP);
-            index++;
+            Value constant;
+            if (count == constants.ssize() && take_constant(start, &constant)) {
+                constants.push_back(constant);
+            }
+            else if (++pending == ArrayAppendMax) {
+                emit_bytes(OP_ARRAY_APPEND, (uint8_t)pending);
+                pending = 0;
+            }
+            count++;
             if (!m_parser->match(TOKEN_COMMA)) break;
         }
+        if (pending > 0) {
+            emit_bytes(OP_ARRAY_APPEND, (uint8_t)pending);
+        }
 
-        patch_array_new(array_size_offset, index);
+        if (constants.ssize() > 0) {
+            ObjArray* array = create_obj_array();
+            array->append(constants.data(), constants.ssize());
+            current_chunk()->m_code[array_new_offset - 1] = OP_ARRAY_COPY;
+            patch_array_new(array_new_offset, make_constant(Value(array)));
+        }
+        else {
+            patch_array_new(array_new_offset, count < MaxConstants ? count : MaxConstants - 1);
+        }
         m_parser->consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array initializer list.");
     }
 
@@ -570,20 +891,34 @@ public:
             set_op = OP_SET_UPVALUE;
         }
         else {
-            arg = identifier_constant(name);
+            arg = global_slot(name);
             get_op = OP_GET_GLOBAL;
             set_op = OP_SET_GLOBAL;
         }
 
         if (can_assign && m_parser->match(TOKEN_EQUAL)) {
             expression();
-            emit_bytes(set_op, arg);
+            if (set_op == OP_SET_LOCAL) m_last_set_local = current_chunk()->code_count();
+            emit_variable_op(set_op, arg);
         }
         else {
-            emit_bytes(get_op, arg);
+            if (get_op == OP_GET_LOCAL && arg < RKConstantBit) {
+                int32_t start = current_chunk()->code_count();
+                m_last_load = {start, start + 2, (uint8_t)arg};
+            }
+            emit_variable_op(get_op, arg);
         }
     }
 
+    // Globals are addressed by a 16-bit slot index, locals and upvalues by a single byte.
+    void emit_variable_op(uint8_t op, int32_t arg) {
+        emit_byte(op);
+        if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) {
+            emit_byte((arg >> 8) & 0xff);
+        }
+        emit_byte(arg & 0xff);
+    }
+
     void variable(bool can_assign) {
         named_variable(m_parser->previous(), can_assign);
     }
@@ -606,18 +941,20 @@ public:
         }
         m_parser->consume(TOKEN_DOT, "Expect '.' after 'super'.");
         m_parser->consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-        uint8_t name = identifier_constant(m_parser->previous());
+        int32_t name = identifier_constant(m_parser->previous());
 
         named_variable(synthetic_token("this"), false);
         if (m_parser->match(TOKEN_LEFT_PAREN)) {
             uint8_t arg_count = argument_list();
             named_variable(synthetic_token("super"), false);
-            emit_bytes(OP_SUPER_INVOKE, name);
+            emit_byte(OP_SUPER_INVOKE);
+            emit_long(name);
             emit_byte(arg_count);
         }
         else {
             named_variable(synthetic_token("super"), false);
-            emit_bytes(OP_GET_SUPER, name);
+            emit_byte(OP_GET_SUPER);
+            emit_long(name);
         }
     }
 
@@ -628,11 +965,77 @@ public:
         variable(false);
     }
 
+    // Evaluates a unary operator the way the VM would. Returns false if the VM would report a runtime error.
+    static bool fold_unary(TokenType op_type, Value a, Value* result) {
+        if (op_type == TOKEN_BANG) {
+            *result = Value(a.is_falsey());
+            return true;
+        }
+        if (!a.is_number()) return false;
+        *result = a.is_int() && a.as_int() != 0 ? Value::int_or_double(-(int64_t)a.as_int()) : Value(-a.as_number());
+        return true;
+    }
+
+    // Evaluates a binary operator the way the VM would. Returns false if the VM would report a runtime error, or
+    // would concatenate into a rope (see RopeMinLength). The result of a concatenation is owned by the caller.
+    bool fold_binary(TokenType op_type, Value a, Value b, Value* result) {
+        if (op_type == TOKEN_EQUAL_EQUAL || op_type == TOKEN_BANG_EQUAL) {
+            *result = Value(Value::equals(a, b) == (op_type == TOKEN_EQUAL_EQUAL));
+            return true;
+        }
+        if (op_type == TOKEN_PLUS && a.is_any_string() && b.is_any_string()) {
+            const char* a_chars;
+            int32_t a_length;
+            string_contents(a, &a_chars, &a_length);
+            const char* b_chars;
+            int32_t b_length;
+            string_contents(b, &b_chars, &b_length);
+            int32_t length = a_length + b_length;
+            if (length >= RopeMinLength) return false;
+            char chars[RopeMinLength];
+            memcpy(chars, a_chars, a_length);
+            memcpy(chars + a_length, b_chars, b_length);
+            *result = m_string_interner->create_string_value(chars, length);
+            if (result->is_obj()) result->obj_incref();
+            return true;
+        }
+        if (!a.is_number() || !b.is_number()) return false;
+
+        // Like the VM, two ints are added, subtracted and compared without going through doubles.
+        bool ints = a.is_int() && b.is_int();
+        int64_t ia = ints ? a.as_int() : 0;
+        int64_t ib = ints ? b.as_int() : 0;
+        double da = a.as_number();
+        double db = b.as_number();
+        switch (op_type) {
+            case TOKEN_GREATER:       *result = Value(ints ? ia > ib : da > db); break;
+            case TOKEN_GREATER_EQUAL: *result = Value(ints ? ia >= ib : da >= db); break;
+            case TOKEN_LESS:          *result = Value(ints ? ia < ib : da < db); break;
+            case TOKEN_LESS_EQUAL:    *result = Value(ints ? ia <= ib : da <= db); break;
+            case TOKEN_PLUS:          *result = ints ? Value::int_or_double(ia + ib) : Value(da + db); break;
+            case TOKEN_MINUS:         *result = ints ? Value::int_or_double(ia - ib) : Value(da - db); break;
+            case TOKEN_STAR:          *result = Value(da * db); break;
+            case TOKEN_SLASH:         *result = Value(da / db); break;
+            default: return false;
+        }
+        return true;
+    }
+
     void unary(bool can_assign) {
         TokenType op_type = m_parser->previous().type;
+        int32_t operand_start = current_chunk()->code_count();
 
         parse_precedence(PREC_UNARY);
 
+        Value operand;
+        int32_t index;
+        Value result;
+        if (trailing_constant() == operand_start && decode_constant(operand_start, &operand, &index) &&
+            fold_unary(op_type, operand, &result)) {
+            emit_folded(operand_start, -1, result);
+            return;
+        }
+
         switch (op_type) {
             case TOKEN_BANG: emit_byte(OP_NOT); break;
             case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
@@ -642,9 +1045,28 @@ public:
 
     void binary(bool can_assign) {
         TokenType op_type = m_parser->previous().type;
+        OperandLoad left = trailing_operand_load();
+        int32_t left_start = trailing_constant();
+        int32_t right_start = current_chunk()->code_count();
         ParseRule rule = get_rule(op_type);
         parse_precedence((Precedence)(rule.precedence + 1));
 
+        if (left_start >= 0 && trailing_constant() == right_start) {
+            Value a, b, result;
+            int32_t index;
+            decode_constant(left_start, &a, &index);
+            decode_constant(right_start, &b, &index);
+            if (fold_binary(op_type, a, b, &result)) {
+                emit_folded(left_start, right_start, result);
+                return;
+            }
+        }
+
+        if (left.start >= 0) {
+            OperandLoad right = trailing_operand_load();
+            if (right.start == left.end && emit_register_binary(op_type, left, right)) return;
+        }
+
         switch (op_type) {
             case TOKEN_BANG_EQUAL:    emit_byte(OP_NOT_EQUAL); break;
             case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
@@ -667,22 +1089,29 @@ public:
 
     void dot(bool can_assign) {
         m_parser->consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-        uint8_t name = identifier_constant(m_parser->previous());
+        int32_t name = identifier_constant(m_parser->previous());
         if (can_assign && m_parser->match(TOKEN_EQUAL)) {
             expression();
-            emit_bytes(OP_SET_PROPERTY, name);
+            emit_byte(OP_SET_PROPERTY);
+            emit_long(name);
+            emit_inline_cache();
         }
         else if (m_parser->match(TOKEN_LEFT_PAREN)) {
             uint8_t arg_count = argument_list();
-            emit_bytes(OP_INVOKE, name);
+            emit_byte(OP_INVOKE);
+            emit_long(name);
             emit_byte(arg_count);
+            emit_inline_cache();
         }
         else {
-            emit_bytes(OP_GET_PROPERTY, name);
+            emit_byte(OP_GET_PROPERTY);
+            emit_long(name);
+            emit_inline_cache();
         }
     }
 
     void literal(bool can_assign) {
+        m_last_constant = current_chunk()->code_count();
         switch (m_parser->previous().type) {
             case TOKEN_FALSE: emit_byte(OP_FALSE); break;
             case TOKEN_NIL: emit_byte(OP_NIL); break;
@@ -713,7 +1142,17 @@ public:
         }
     }
 
-    uint8_t identifier_constant(Token name) {
+    int32_t global_slot(Token name) {
+        ObjString* str = m_string_interner->create_string(name.start, name.length);
+        int32_t slot = m_globals->resolve(str);
+        if (slot < 0) {
+            m_parser->error("Too many global variables.");
+            return 0;
+        }
+        return slot;
+    }
+
+    int32_t identifier_constant(Token name) {
         ObjString* str = m_string_interner->create_string(name.start, name.length);
         Value value = Value(str);
         value.obj_incref();
@@ -798,13 +1237,13 @@ public:
         add_local(name);
     }
 
-    uint8_t parse_variable(const char* error_message) {
+    int32_t parse_variable(const char* error_message) {
         m_parser->consume(TOKEN_IDENTIFIER, error_message);
 
         declare_variable();
         if (m_scope_depth > 0) return 0;
 
-        return identifier_constant(m_parser->previous());
+        return global_slot(m_parser->previous());
     }
 
     void mark_initialized() {
@@ -812,13 +1251,13 @@ public:
         m_locals[m_local_count - 1].depth = m_scope_depth;
     }
 
-    void define_variable(uint8_t global) {
+    void define_variable(int32_t global) {
         if (m_scope_depth > 0) {
             mark_initialized();
             return;
         }
 
-        emit_bytes(OP_DEFINE_GLOBAL, global);
+        emit_variable_op(OP_DEFINE_GLOBAL, global);
     }
 
     uint8_t argument_list() {
@@ -836,7 +1275,31 @@ public:
         return arg_count;
     }
 
+    // With a constant left operand, only one of the operands is left: a falsey left operand for and, a truthy one
+    // for or, and the right operand otherwise.
+    bool fold_logical(bool is_and, Precedence precedence) {
+        int32_t left_start = trailing_constant();
+        if (left_start < 0) return false;
+        Value left;
+        int32_t index;
+        decode_constant(left_start, &left, &index);
+        m_stats->folded_expressions++;
+        if (left.is_falsey() == is_and) {
+            int32_t right_start = current_chunk()->code_count();
+            parse_precedence(precedence);
+            discard_code(right_start);
+            m_last_constant = left_start;
+        }
+        else {
+            discard_constant(left_start);
+            parse_precedence(precedence);
+        }
+        return true;
+    }
+
     void and_(bool can_assign) {
+        if (fold_logical(true, PREC_AND)) return;
+
         int32_t end_jump = emit_jump(OP_JUMP_IF_FALSE);
 
         emit_byte(OP_POP);
@@ -846,6 +1309,8 @@ public:
     }
 
     void or_(bool can_assign) {
+        if (fold_logical(false, PREC_OR)) return;
+
         int32_t else_jump = emit_jump(OP_JUMP_IF_FALSE);
         int32_t end_jump = emit_jump(OP_JUMP);
 
@@ -857,6 +1322,28 @@ public:
     }
 
     void ternary(bool can_assign) {
+        int32_t condition_start = trailing_constant();
+        if (condition_start >= 0) {
+            Value condition;
+            int32_t index;
+            decode_constant(condition_start, &condition, &index);
+            bool taken = !condition.is_falsey();
+            discard_constant(condition_start);
+            int32_t start = current_chunk()->code_count();
+            parse_precedence(PREC_TERNARY);
+            if (!taken) discard_code(start);
+            m_parser->consume(TOKEN_COLON, "Expect ':' after expression.");
+            int32_t else_start = current_chunk()->code_count();
+            int32_t kept_constant = m_last_constant;
+            parse_precedence(PREC_TERNARY);
+            if (taken) {
+                discard_code(else_start);
+                m_last_constant = kept_constant;
+            }
+            m_stats->dead_branches++;
+            return;
+        }
+
         int32_t else_jump = emit_jump(OP_JUMP_IF_FALSE);
 
         emit_byte(OP_POP);
@@ -886,6 +1373,7 @@ private:
 
     Parser* m_parser = nullptr;
     StringInterner* m_string_interner;
+    GlobalTable* m_globals;
     ObjFunction* m_function;
     FunctionType m_function_type = FunctionType::Script;
 
@@ -896,6 +1384,17 @@ private:
     int32_t m_scope_depth = 0;
     Compiler* m_enclosing = nullptr;
     ClassCompiler* m_class_compiler = nullptr;
+
+    // Register backend: emit OP_R_* instructions where the operands allow it.
+    bool m_register_ops = false;
+    OperandLoad m_last_load;
+    int32_t m_last_register_op = -1;
+    int32_t m_last_set_local = -1;
+    int32_t m_last_jump_target = 0;
+
+    CompilerStats* m_stats;
+    CompilerOptions m_options;
+    int32_t m_last_constant = -1; // See trailing_constant()
 };
 
 #undef MEMBER_FN
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "vm/gc.h"
+#include "vm/allocator.h"
+
+#include "vm/string.h"
+#include "vm/string_interner.h"
+#include "vm/array.h"
+#include "vm/table.h"
+#include "vm/object.h"
+
+Heap g_heap;
+
+void Heap::track(Obj* obj) {
+    obj->gc_prev = nullptr;
+    obj->gc_next = objects;
+    if (objects != nullptr) objects->gc_prev = obj;
+    objects = obj;
+    object_count++;
+}
+
+void Heap::untrack(Obj* obj) {
+    if (obj->gc_prev != nullptr) obj->gc_prev->gc_next = obj->gc_next;
+    else objects = obj->gc_next;
+    if (obj->gc_next != nullptr) obj->gc_next->gc_prev = obj->gc_prev;
+    obj->gc_prev = obj->gc_next = nullptr;
+    object_count--;
+}
+
+#ifdef LOX_DEFERRED_RC
+void zct_push(Obj* obj) {
+    if (obj->in_zct) return;
+    obj->in_zct = 1;
+    g_heap.zct.push_back(obj);
+}
+
+void Heap::process_zct() {
+    while (!zct.empty()) {
+        Obj* obj = zct.pop_back();
+        obj->in_zct = 0;
+        if (obj->refcount == 0) {
+            Value(obj).obj_free();
+            stats.zct_objects_freed++;
+        }
+    }
+    stats.zct_reconciliations++;
+}
+#endif
+
+void Heap::mark_value(Value value) {
+    if (value.is_obj()) mark_object(value.as_obj());
+}
+
+void Heap::mark_object(Obj* obj) {
+    if (obj == nullptr || obj->marked) return;
+    obj->marked = 1;
+    if (obj->type != OBJ_STRING && obj->type != OBJ_NATIVEFUN) {
+        m_gray_stack.push_back(obj);
+    }
+}
+
+static void mark_table(Heap* heap, ObjTable* table) {
+    for (int32_t i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        heap->mark_value(entry->key);
+        heap->mark_value(entry->value);
+    }
+}
+
+static void mark_shape_tree(Heap* heap, Shape* shape) {
+    if (shape->key != nullptr) heap->mark_object(reinterpret_cast<Obj*>(shape->key));
+    for (ShapeTransition& transition : shape->transitions) {
+        mark_shape_tree(heap, transition.shape);
+    }
+}
+
+void Heap::blacken_object(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_UPVALUE: {
+            mark_value(*reinterpret_cast<ObjUpvalue*>(obj)->location);
+            break;
+        }
+        case OBJ_ARRAY: {
+            ObjArray* array = reinterpret_cast<ObjArray*>(obj);
+            for (int32_t i = 0; i < array->count; i++) {
+                mark_value(array->values[i]);
+            }
+            break;
+        }
+        case OBJ_TABLE: {
+            mark_table(this, reinterpret_cast<ObjTable*>(obj));
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* fn = reinterpret_cast<ObjFunction*>(obj);
+            mark_object(reinterpret_cast<Obj*>(fn->name));
+            for (Value constant : fn->chunk.m_constants) {
+                mark_value(constant);
+            }
+            for (InlineCache& cache : fn->chunk.m_inline_caches) {
+                mark_object(reinterpret_cast<Obj*>(cache.bound_method));
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = reinterpret_cast<ObjClosure*>(obj);
+            mark_object(reinterpret_cast<Obj*>(closure->function));
+            for (int32_t i = 0; i < closure->upvalue_count; i++) {
+                mark_object(reinterpret_cast<Obj*>(closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = reinterpret_cast<ObjClass*>(obj);
+            mark_object(reinterpret_cast<Obj*>(klass->name));
+            mark_table(this, &klass->methods);
+            mark_shape_tree(this, klass->root_shape);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = reinterpret_cast<ObjInstance*>(obj);
+            mark_object(reinterpret_cast<Obj*>(inst->klass));
+            for (int32_t i = 0; i < inst->shape->slot_count; i++) {
+                mark_value(inst->fields[i]);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = reinterpret_cast<ObjBoundMethod*>(obj);
+            mark_value(bound->receiver);
+            mark_object(reinterpret_cast<Obj*>(bound->method));
+            break;
+        }
+        case OBJ_ROPE: {
+            mark_object(reinterpret_cast<Obj*>(reinterpret_cast<ObjRope*>(obj)->flat));
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_NATIVEFUN:
+            break;
+    }
+}
+
+// Frees an unreachable object without touching the refcounts of anything it points to.
+// Its children are either garbage themselves (and freed by the same sweep) or still reachable,
+// in which case the reference it held is simply never given back: an overcounted object can't
+// be freed early by refcounting, and the next collection still reclaims it once it's unreachable.
+static void free_garbage(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_STRING: {
+            ObjString* str = reinterpret_cast<ObjString*>(obj);
+            if (str->obj.interned) g_string_interner->remove_string(str);
+            size_t size = obj_string_size(str->length);
+            str->~ObjString();
+            g_allocator.deallocate(OBJ_STRING, str, size);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            g_allocator.deallocate(OBJ_UPVALUE, obj, sizeof(ObjUpvalue));
+            break;
+        }
+        case OBJ_ARRAY: {
+            ObjArray* array = reinterpret_cast<ObjArray*>(obj);
+            free(array->values);
+            array->~ObjArray();
+            g_allocator.deallocate(OBJ_ARRAY, array, sizeof(ObjArray));
+            break;
+        }
+        case OBJ_TABLE: {
+            ObjTable* table = reinterpret_cast<ObjTable*>(obj);
+            free(table->entries);
+            table->~ObjTable();
+            g_allocator.deallocate(OBJ_TABLE, table, sizeof(ObjTable));
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* fn = reinterpret_cast<ObjFunction*>(obj);
+            // Keep ~Chunk from releasing the constants and cached bound methods
+            fn->chunk.m_constants.clear();
+            for (InlineCache& cache : fn->chunk.m_inline_caches) {
+                cache.bound_method = nullptr;
+            }
+            fn->~ObjFunction();
+            g_allocator.deallocate(OBJ_FUNCTION, fn, sizeof(ObjFunction));
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = reinterpret_cast<ObjClosure*>(obj);
+            free(closure->upvalues);
+            g_allocator.deallocate(OBJ_CLOSURE, closure, sizeof(ObjClosure));
+            break;
+        }
+        case OBJ_NATIVEFUN: {
+            g_allocator.deallocate(OBJ_NATIVEFUN, obj, sizeof(ObjNativeFun));
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = reinterpret_cast<ObjClass*>(obj);
+            free(klass->methods.entries);
+            free_shape_tree(klass->root_shape, false);
+            g_allocator.deallocate(OBJ_CLASS, klass, sizeof(ObjClass));
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = reinterpret_cast<ObjInstance*>(obj);
+            if (inst->fields != inst->inline_fields()) {
+                free(inst->fields);
+            }
+            g_allocator.deallocate(OBJ_INSTANCE, inst, obj_instance_size(inst->inline_capacity));
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            g_allocator.deallocate(OBJ_BOUND_METHOD, obj, sizeof(ObjBoundMethod));
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = reinterpret_cast<ObjRope*>(obj);
+            if (rope->buffer != nullptr) release_string_buffer(rope->buffer);
+            rope->~ObjRope();
+            g_allocator.deallocate(OBJ_ROPE, rope, sizeof(ObjRope));
+            break;
+        }
+    }
+}
+
+void Heap::sweep() {
+    Obj* obj = objects;
+    while (obj != nullptr) {
+        Obj* next = obj->gc_next;
+        if (obj->marked) {
+            obj->marked = 0;
+        }
+        else {
+            untrack(obj);
+            m_garbage.push_back(obj);
+        }
+        obj = next;
+    }
+
+    // Everything is unlinked before anything is freed, so no garbage object is touched after its memory is gone.
+    for (Obj* garbage : m_garbage) {
+        free_garbage(garbage);
+    }
+    stats.objects_reclaimed += m_garbage.size();
+    m_garbage.clear();
+}
+
+void Heap::trace_references() {
+    while (!m_gray_stack.empty()) {
+        blacken_object(m_gray_stack.pop_back());
+    }
+}
+
+void Heap::finish_collection(std::chrono::steady_clock::time_point start) {
+    next_gc = (int64_t)((double)object_count * config.growth_factor);
+    if (next_gc < config.initial_threshold) next_gc = config.initial_threshold;
+
+    double pause_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.collections++;
+    stats.total_pause_ms += pause_ms;
+    if (pause_ms > stats.max_pause_ms) stats.max_pause_ms = pause_ms;
+}
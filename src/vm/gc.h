@@ -0,0 +1,87 @@
+#pragma once
+
+#include "core/vector.h"
+
+#include "vm/value.h"
+
+#include <chrono>
+
+// Backup tracing collector for the reference counted heap.
+// Reference counting can't reclaim cycles (an instance holding a closure that captures it, a table
+// containing itself, ...), so every heap object is also linked into g_heap and a mark-sweep pass
+// over the VM roots periodically frees whatever is no longer reachable.
+
+struct GCConfig {
+    bool enabled = true;
+    int64_t initial_threshold = 1 << 16;  // Live objects before the first collection
+    double growth_factor = 2.0;           // Next collection once the live count grows by this factor
+};
+
+struct GCStats {
+    uint64_t collections = 0;
+    uint64_t objects_reclaimed = 0;
+    double total_pause_ms = 0.0;
+    double max_pause_ms = 0.0;
+    uint64_t zct_reconciliations = 0;
+    uint64_t zct_objects_freed = 0;
+};
+
+struct Heap {
+    Obj* objects = nullptr;
+    int64_t object_count = 0;
+    int64_t next_gc = GCConfig().initial_threshold;
+
+    GCConfig config;
+    GCStats stats;
+
+    void configure(const GCConfig& new_config) {
+        config = new_config;
+        next_gc = config.initial_threshold;
+    }
+
+    bool should_collect() const {
+        return config.enabled && object_count >= next_gc;
+    }
+
+    void track(Obj* obj);
+    void untrack(Obj* obj);
+
+    void mark_value(Value value);
+    void mark_object(Obj* obj);
+
+#ifdef LOX_DEFERRED_RC
+    // Zero count table: objects whose refcount hit zero while the (uncounted) VM stack may still point to them.
+    static constexpr int32_t ZCTReconcileThreshold = 4096;
+
+    Vector<Obj*> zct;
+
+    bool should_reconcile() const {
+        return zct.ssize() >= ZCTReconcileThreshold;
+    }
+
+    // Frees every queued object whose refcount is still zero, including children that drop to zero meanwhile.
+    // The caller has to pin everything the stack points to first, see VM::reconcile_stack().
+    void process_zct();
+#endif
+
+    // mark_roots() marks the roots, everything reachable from them is kept and the rest is freed.
+    template <typename MarkRoots>
+    void collect(MarkRoots&& mark_roots) {
+        auto start = std::chrono::steady_clock::now();
+        mark_roots();
+        trace_references();
+        sweep();
+        finish_collection(start);
+    }
+
+private:
+    void blacken_object(Obj* obj);
+    void trace_references();
+    void sweep();
+    void finish_collection(std::chrono::steady_clock::time_point start);
+
+    Vector<Obj*> m_gray_stack;
+    Vector<Obj*> m_garbage;
+};
+
+extern Heap g_heap;
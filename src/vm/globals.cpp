@@ -0,0 +1,48 @@
+#include "vm/globals.h"
+
+#include "vm/string.h"
+#include "vm/gc.h"
+
+void GlobalTable::init() {
+    indices.init();
+}
+
+void GlobalTable::clear() {
+    indices.clear();
+    for (Value& value : values) {
+        if (value.is_obj()) value.obj_decref();
+    }
+    for (ObjString* name : names) {
+        Value(name).obj_decref();
+    }
+    values.clear();
+    names.clear();
+}
+
+int32_t GlobalTable::resolve(ObjString* name) {
+    Value index;
+    if (indices.get_string_key(name, &index)) {
+        return (int32_t)index.as_number();
+    }
+    if (values.ssize() == MaxSlots) {
+        return -1;
+    }
+
+    int32_t slot = values.ssize();
+    Value name_value = Value(name);
+    name_value.obj_incref();
+    indices.set_string_key(name, Value((double)slot));
+    name_value.obj_incref();
+    names.push_back(name);
+    values.push_back(Value::undefined());
+    return slot;
+}
+
+void GlobalTable::mark() {
+    for (Value value : values) {
+        g_heap.mark_value(value);
+    }
+    for (ObjString* name : names) {
+        g_heap.mark_object(&name->obj);
+    }
+}
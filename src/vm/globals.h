@@ -0,0 +1,28 @@
+#pragma once
+
+#include "core/vector.h"
+
+#include "vm/value.h"
+#include "vm/table.h"
+
+// Global variables, stored in a dense array of slots.
+// The compiler resolves every global name to a slot index once, so OP_GET_GLOBAL/OP_SET_GLOBAL are an array
+// access plus an undefined check instead of a hash lookup. A name gets its slot the first time it's compiled,
+// which may be before its definition runs (e.g. a function calling a function declared after it). The slot
+// then stays undefined until OP_DEFINE_GLOBAL assigns it.
+struct GlobalTable {
+    static constexpr int32_t MaxSlots = UINT16_MAX + 1;
+
+    ObjTable indices;           // Name -> slot index
+    Vector<Value> values;
+    Vector<ObjString*> names;
+
+    void init();
+    void clear();
+
+    // Returns the slot of the name, adding an undefined one if it doesn't have one yet.
+    // Returns -1 if all MaxSlots slots are taken.
+    int32_t resolve(ObjString* name);
+
+    void mark();
+};
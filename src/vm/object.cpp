@@ -1,37 +1,48 @@
 #include "vm/object.h"
+#include "vm/gc.h"
+#include "vm/allocator.h"
 
 template <typename T>
-T* new_object() {
-    void* raw_data = malloc(sizeof(T));
+T* new_object(ObjType type) {
+    void* raw_data = g_allocator.allocate(type, sizeof(T));
     T* obj = static_cast<T*>(raw_data);
     new (obj) T();
+    g_heap.track(&obj->obj);
     return obj;
 }
 
 template <typename T>
 void delete_object(T* obj) {
+    g_heap.untrack(&obj->obj);
+    ObjType type = obj->obj.type;
     obj->~T();
-    free(obj);
+    g_allocator.deallocate(type, obj, sizeof(T));
 }
 
 ObjUpvalue* create_obj_upvalue(Value* slot) {
-    ObjUpvalue* upvalue = new_object<ObjUpvalue>();
+    ObjUpvalue* upvalue = new_object<ObjUpvalue>(OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->closed = Value();
     upvalue->next = nullptr;
-    if (slot->is_obj()) slot->obj_incref();
+    slot->stack_incref();
     return upvalue;
 }
 
 void free_obj_upvalue(ObjUpvalue* upvalue) {
-    if (upvalue && upvalue->location->is_obj()) {
+#ifdef LOX_DEFERRED_RC
+    // An open upvalue points into the stack, and stack slots don't own references
+    bool owns_value = upvalue->location == &upvalue->closed;
+#else
+    bool owns_value = true;
+#endif
+    if (owns_value && upvalue->location->is_obj()) {
         upvalue->location->obj_decref();
     }
     delete_object<ObjUpvalue>(upvalue);
 }
 
 ObjFunction *create_obj_function() {
-    ObjFunction* fn = new_object<ObjFunction>();
+    ObjFunction* fn = new_object<ObjFunction>(OBJ_FUNCTION);
     fn->arity = 0;
     fn->upvalue_count = 0;
     fn->name = nullptr;
@@ -39,7 +50,7 @@ ObjFunction *create_obj_function() {
 }
 
 void free_obj_function(ObjFunction *fn) {
-    free(fn->name);
+    if (fn->name != nullptr) Value(fn->name).obj_decref();
     delete_object(fn);
 }
 
@@ -48,7 +59,7 @@ ObjClosure *create_obj_closure(ObjFunction* function) {
     for (int32_t i = 0; i < function->upvalue_count; i++) {
         upvalues[i] = nullptr;
     }
-    ObjClosure* closure = new_object<ObjClosure>();
+    ObjClosure* closure = new_object<ObjClosure>(OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
@@ -61,7 +72,7 @@ void free_obj_closure(ObjClosure *closure) {
 }
 
 ObjNativeFun* create_obj_native_fun(NativeFun native_fn) {
-    ObjNativeFun* fn = new_object<ObjNativeFun>();
+    ObjNativeFun* fn = new_object<ObjNativeFun>(OBJ_NATIVEFUN);
     fn->function = native_fn;
     return fn;
 }
@@ -71,36 +82,79 @@ void free_obj_native_fun(ObjNativeFun* native_fn) {
 }
 
 ObjClass *create_obj_class(ObjString *name) {
-    ObjClass* klass = new_object<ObjClass>();
+    ObjClass* klass = new_object<ObjClass>(OBJ_CLASS);
     klass->name = name;
     klass->methods.init();
+    klass->root_shape = create_root_shape();
+    klass->field_count_hint = 0;
     return klass;
 }
 
 void free_obj_class(ObjClass *klass) {
     klass->methods.clear();
+    free_shape_tree(klass->root_shape);
     delete_object(klass);
 }
 
 ObjInstance *create_obj_instance(ObjClass *klass) {
-    ObjInstance* inst = new_object<ObjInstance>();
+    // Reserve inline room for as many fields as earlier instances of the class ended up with.
+    int32_t capacity = klass->field_count_hint;
+    void* raw_data = g_allocator.allocate(OBJ_INSTANCE, obj_instance_size(capacity));
+    ObjInstance* inst = new (raw_data) ObjInstance();
+    g_heap.track(&inst->obj);
+    Value(klass).obj_incref();
     inst->klass = klass;
-    inst->fields.init();
+    inst->shape = klass->root_shape;
+    inst->fields = inst->inline_fields();
+    inst->capacity = capacity;
+    inst->inline_capacity = capacity;
     return inst;
 }
 
 void free_obj_instance(ObjInstance *inst) {
-    inst->fields.clear();
-    delete_object(inst);
+    for (int32_t i = 0; i < inst->shape->slot_count; i++) {
+        Value& field = inst->fields[i];
+        if (field.is_obj()) field.obj_decref();
+    }
+    if (inst->fields != inst->inline_fields()) {
+        free(inst->fields);
+    }
+    Value(inst->klass).obj_decref();
+    g_heap.untrack(&inst->obj);
+    size_t size = obj_instance_size(inst->inline_capacity);
+    inst->~ObjInstance();
+    g_allocator.deallocate(OBJ_INSTANCE, inst, size);
+}
+
+void instance_add_field(ObjInstance* inst, Shape* shape, Value value) {
+    int32_t slot = shape->slot_count - 1;
+    if (slot >= inst->capacity) {
+        int32_t capacity = inst->capacity < 4 ? 4 : inst->capacity * 2;
+        Value* fields = static_cast<Value*>(malloc(sizeof(Value) * capacity));
+        memcpy(fields, inst->fields, sizeof(Value) * inst->shape->slot_count);
+        if (inst->fields != inst->inline_fields()) {
+            free(inst->fields);
+        }
+        inst->fields = fields;
+        inst->capacity = capacity;
+    }
+    inst->fields[slot] = value;
+    inst->shape = shape;
+
+    if (shape->slot_count > inst->klass->field_count_hint) {
+        inst->klass->field_count_hint = shape->slot_count;
+    }
 }
 
 ObjBoundMethod *create_obj_bound_method(Value receiver, ObjClosure *method) {
-    ObjBoundMethod* bound_method = new_object<ObjBoundMethod>();
+    ObjBoundMethod* bound_method = new_object<ObjBoundMethod>(OBJ_BOUND_METHOD);
     bound_method->receiver = receiver;
     bound_method->method = method;
+    if (receiver.is_obj()) receiver.obj_incref();
     return bound_method;
 }
 
 void free_obj_bound_method(ObjBoundMethod *bound_method) {
+    if (bound_method->receiver.is_obj()) bound_method->receiver.obj_decref();
     delete_object(bound_method);
 }
@@ -3,6 +3,7 @@
 #include "vm/value.h"
 #include "vm/chunk.h"
 #include "vm/table.h"
+#include "vm/shape.h"
 
 struct ObjUpvalue {
     Obj obj = OBJ_UPVALUE;
@@ -37,14 +38,26 @@ struct ObjClass {
     Obj obj = OBJ_CLASS;
     ObjString* name;
     ObjTable methods;
+    Shape* root_shape;
+    int32_t field_count_hint; // Most fields seen on an instance so far, used to size new instances
 };
 
 struct ObjInstance {
     Obj obj = OBJ_INSTANCE;
     ObjClass* klass;
-    ObjTable fields;
+    Shape* shape;
+    Value* fields;      // Indexed by shape slot, points at inline_fields() until it outgrows them
+    int32_t capacity;
+    int32_t inline_capacity;
+
+    Value* inline_fields() { return reinterpret_cast<Value*>(this + 1); }
 };
 
+// Allocation size of an instance with room for inline_capacity fields after the header.
+inline size_t obj_instance_size(int32_t inline_capacity) {
+    return sizeof(ObjInstance) + sizeof(Value) * inline_capacity;
+}
+
 struct ObjBoundMethod {
     Obj obj = OBJ_BOUND_METHOD;
     Value receiver;
@@ -68,6 +81,7 @@ void free_obj_class(ObjClass* klass);
 
 ObjInstance* create_obj_instance(ObjClass* klass);
 void free_obj_instance(ObjInstance* inst);
+void instance_add_field(ObjInstance* inst, Shape* shape, Value value);
 
 ObjBoundMethod* create_obj_bound_method(Value receiver, ObjClosure* method);
 void free_obj_bound_method(ObjBoundMethod* bound_method);
\ No newline at end of file
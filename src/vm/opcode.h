@@ -4,6 +4,7 @@
 
 #define OPCODE_LIST(X)    \
     X(OP_CONSTANT)        \
+    X(OP_CONSTANT_LONG)   \
     X(OP_NIL)             \
     X(OP_TRUE)            \
     X(OP_FALSE)           \
@@ -30,6 +31,9 @@
     X(OP_JUMP)            \
     X(OP_JUMP_IF_FALSE)   \
     X(OP_LOOP)            \
+    X(OP_JUMP_LONG)       \
+    X(OP_JUMP_IF_FALSE_LONG) \
+    X(OP_LOOP_LONG)       \
     X(OP_CALL)            \
     X(OP_INVOKE)          \
     X(OP_SUPER_INVOKE)    \
@@ -40,7 +44,10 @@
     X(OP_INHERIT)         \
     X(OP_METHOD)          \
     X(OP_ARRAY_NEW)       \
+    X(OP_ARRAY_COPY)      \
+    X(OP_ARRAY_APPEND)    \
     X(OP_TABLE_NEW)       \
+    X(OP_TABLE_BUILD)     \
     X(OP_GET)             \
     X(OP_SET)             \
     X(OP_GET_NOPOP)       \
@@ -48,6 +55,35 @@
     X(OP_GET_PROPERTY)    \
     X(OP_SET_PROPERTY)    \
     X(OP_GET_SUPER)       \
+    X(OP_R_MOVE)          \
+    X(OP_R_EQUAL)         \
+    X(OP_R_NOT_EQUAL)     \
+    X(OP_R_GREATER)       \
+    X(OP_R_GREATER_EQUAL) \
+    X(OP_R_LESS)          \
+    X(OP_R_LESS_EQUAL)    \
+    X(OP_R_ADD)           \
+    X(OP_R_SUBTRACT)      \
+    X(OP_R_MULTIPLY)      \
+    X(OP_R_DIVIDE)        \
+    X(OP_ADD_LOCAL_LOCAL) \
+    X(OP_LESS_LOCAL_CONST_JUMP) \
+    X(OP_GET_THIS_PROPERTY) \
+    X(OP_ADD_INT)         \
+    X(OP_SUBTRACT_INT)    \
+    X(OP_MULTIPLY_INT)    \
+    X(OP_GREATER_INT)     \
+    X(OP_GREATER_EQUAL_INT) \
+    X(OP_LESS_INT)        \
+    X(OP_LESS_EQUAL_INT)  \
+    X(OP_ADD_NUMBER)      \
+    X(OP_SUBTRACT_NUMBER) \
+    X(OP_MULTIPLY_NUMBER) \
+    X(OP_DIVIDE_NUMBER)   \
+    X(OP_GREATER_NUMBER)  \
+    X(OP_GREATER_EQUAL_NUMBER) \
+    X(OP_LESS_NUMBER)     \
+    X(OP_LESS_EQUAL_NUMBER) \
     X(OP_INVALID)
 
 enum OpCode : uint8_t {
@@ -58,3 +94,40 @@ enum OpCode : uint8_t {
 };
 
 extern const char* g_opcode_str[OP_COUNT];
+
+// Operand widths. OP_CONSTANT takes a 1-byte constant index and OP_CONSTANT_LONG a 3-byte one. Every other
+// instruction that refers to a constant (property and method names, classes, closures, literal templates and
+// layouts) takes a 3-byte index. Jumps take a 2-byte offset, or a 3-byte one for the _LONG variants.
+// Multi-byte operands are big-endian.
+static constexpr int32_t MaxConstants = 1 << 24;
+static constexpr int32_t MaxJump = (1 << 24) - 1;
+
+inline bool is_jump(uint8_t instr) {
+    return instr == OP_JUMP || instr == OP_JUMP_IF_FALSE || instr == OP_LOOP ||
+           instr == OP_JUMP_LONG || instr == OP_JUMP_IF_FALSE_LONG || instr == OP_LOOP_LONG;
+}
+
+inline bool is_long_jump(uint8_t instr) {
+    return instr == OP_JUMP_LONG || instr == OP_JUMP_IF_FALSE_LONG || instr == OP_LOOP_LONG;
+}
+
+// Operands of the register instructions (OP_R_*), only emitted by the register backend.
+// OP_R_MOVE A B and OP_R_<binary op> A B C compute R[A] = RK(B) (op RK(C)), where registers are the
+// local slots of the current frame:
+// - A is a register, or RegisterPush to push the result onto the stack instead.
+// - B and C are RK operands: a register below RKConstantBit, otherwise the constant RK & ~RKConstantBit.
+static constexpr uint8_t RegisterPush = 0xff;
+static constexpr uint8_t RKConstantBit = 0x80;
+
+// OP_ARRAY_APPEND N moves the top N values on the stack into the array below them. Array literals append their
+// elements every ArrayAppendMax values, so a long literal doesn't need a deep stack.
+static constexpr int32_t ArrayAppendMax = 32;
+
+// OP_TABLE_BUILD L N pops N values and pushes a table made from the layout table in constant L, which maps each
+// key to the index of its value among them. Table literals pass at most TableBuildMax values this way and set any
+// keys after that one by one.
+static constexpr int32_t TableBuildMax = 32;
+
+// The OP_*_INT and OP_*_NUMBER instructions are never emitted by the compiler. The VM rewrites the generic
+// arithmetic and comparison instructions to them in place once it has seen their operand types, see "Quickening"
+// in VM::run().
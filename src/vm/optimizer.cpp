@@ -0,0 +1,246 @@
+#include "vm/optimizer.h"
+
+#include "vm/peephole.h"
+
+static bool is_forward_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_LONG;
+}
+
+static bool is_conditional_jump(uint8_t op) {
+    return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_FALSE_LONG;
+}
+
+static bool is_loop(uint8_t op) {
+    return op == OP_LOOP || op == OP_LOOP_LONG;
+}
+
+static void decode(Chunk* chunk, IRFunction* ir) {
+    int32_t count = chunk->code_count();
+    Vector<int32_t> index_of(count + 1);
+    ir->chunk = chunk;
+    for (int32_t offset = 0; offset < count; offset += chunk->instruction_length(offset)) {
+        index_of[offset] = ir->instrs.ssize();
+        ir->instrs.push_back({offset, chunk->instruction_length(offset), -1, chunk->m_code[offset], false});
+    }
+    index_of[count] = ir->instrs.ssize();
+    for (IRInstr& instr : ir->instrs) {
+        if (is_jump(instr.op)) instr.target = index_of[chunk->jump_target(instr.offset)];
+    }
+}
+
+// Writes the instructions that weren't removed back into the chunk. Forward jumps are written in the _LONG form,
+// like the compiler emits them, so the peephole pass can shorten them; loops get the short form if it fits.
+static void encode(IRFunction* ir) {
+    const Chunk* chunk = ir->chunk;
+    int32_t count = ir->instrs.ssize();
+    Vector<uint8_t> new_code;
+    Vector<int32_t> new_lines;
+    Vector<int32_t> new_offsets(count + 1);
+    new_code.reserve(chunk->code_count());
+    new_lines.reserve(chunk->code_count());
+
+    for (int32_t i = 0; i < count; i++) {
+        const IRInstr& instr = ir->instrs[i];
+        new_offsets[i] = new_code.ssize();
+        if (instr.removed) continue;
+        int32_t line = chunk->m_lines[instr.offset];
+        auto emit = [&](uint8_t byte) {
+            new_code.push_back(byte);
+            new_lines.push_back(line);
+        };
+
+        if (is_loop(instr.op)) {
+            int32_t distance = new_code.ssize() + 3 - new_offsets[instr.target];
+            bool wide = distance > UINT16_MAX;
+            if (wide) distance++;
+            emit(wide ? OP_LOOP_LONG : OP_LOOP);
+            if (wide) emit((distance >> 16) & 0xff);
+            emit((distance >> 8) & 0xff);
+            emit(distance & 0xff);
+        }
+        else if (is_jump(instr.op)) {
+            // Patched below
+            emit(is_forward_jump(instr.op) ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+            emit(0xff);
+            emit(0xff);
+            emit(0xff);
+        }
+        else {
+            for (int32_t j = 0; j < instr.length; j++) {
+                emit(chunk->m_code[instr.offset + j]);
+            }
+        }
+    }
+    new_offsets[count] = new_code.ssize();
+
+    for (int32_t i = 0; i < count; i++) {
+        const IRInstr& instr = ir->instrs[i];
+        if (instr.removed || !is_jump(instr.op) || is_loop(instr.op)) continue;
+        int32_t operand = new_offsets[i] + 1;
+        int32_t distance = new_offsets[instr.target] - (operand + 3);
+        new_code[operand] = (distance >> 16) & 0xff;
+        new_code[operand + 1] = (distance >> 8) & 0xff;
+        new_code[operand + 2] = distance & 0xff;
+    }
+
+    swap(ir->chunk->m_code, new_code);
+    swap(ir->chunk->m_lines, new_lines);
+}
+
+// Jump threading: a jump that lands on an unconditional jump goes straight to where that one goes, and a
+// conditional jump that lands on another conditional jump (which sees the same falsey value) goes to its target.
+// A jump landing on a loop instruction becomes that loop instruction, as at the end of an if inside a loop body.
+static int32_t thread_jumps(IRFunction* ir) {
+    int32_t count = ir->instrs.ssize();
+    int32_t changes = 0;
+    for (int32_t i = 0; i < count; i++) {
+        IRInstr& instr = ir->instrs[i];
+        if (instr.removed || !(is_forward_jump(instr.op) || is_conditional_jump(instr.op))) continue;
+        int32_t target = instr.target;
+        while (target < count) {
+            const IRInstr& next = ir->instrs[target];
+            if (next.removed) {
+                target++;
+            }
+            else if (is_forward_jump(next.op) || (is_conditional_jump(instr.op) && is_conditional_jump(next.op))) {
+                // Forward jumps only go forward, so this ends
+                target = next.target;
+            }
+            else {
+                break;
+            }
+        }
+        // Only if the loop goes back past the jump, which a loop whose body is empty doesn't
+        if (target < count && is_forward_jump(instr.op) && is_loop(ir->instrs[target].op) &&
+            ir->instrs[target].target <= i) {
+            instr.op = OP_LOOP;
+            target = ir->instrs[target].target;
+        }
+        if (target != instr.target) {
+            instr.target = target;
+            changes++;
+        }
+    }
+    return changes;
+}
+
+// Removes the instructions that no path from the start of the chunk reaches, like the code after a return.
+static int32_t remove_unreachable_code(IRFunction* ir) {
+    int32_t count = ir->instrs.ssize();
+    Vector<uint8_t> reached(count + 1);
+    for (int32_t i = 0; i <= count; i++) reached[i] = 0;
+    Vector<int32_t> worklist;
+    worklist.push_back(0);
+    reached[0] = 1;
+    while (!worklist.empty()) {
+        int32_t i = worklist.pop_back();
+        if (i >= count) continue;
+        const IRInstr& instr = ir->instrs[i];
+        int32_t successors[2];
+        int32_t successor_count = 0;
+        if (instr.removed) {
+            successors[successor_count++] = i + 1;
+        }
+        else if (is_forward_jump(instr.op) || is_loop(instr.op)) {
+            successors[successor_count++] = instr.target;
+        }
+        else if (is_conditional_jump(instr.op)) {
+            successors[successor_count++] = i + 1;
+            successors[successor_count++] = instr.target;
+        }
+        else if (instr.op != OP_RETURN) {
+            successors[successor_count++] = i + 1;
+        }
+        for (int32_t j = 0; j < successor_count; j++) {
+            if (reached[successors[j]]) continue;
+            reached[successors[j]] = 1;
+            worklist.push_back(successors[j]);
+        }
+    }
+
+    int32_t changes = 0;
+    for (int32_t i = 0; i < count; i++) {
+        if (!reached[i] && !ir->instrs[i].removed) {
+            ir->instrs[i].removed = true;
+            changes++;
+        }
+    }
+    return changes;
+}
+
+// Dead store elimination: removes stores to local slots that the function never reads and no closure captures.
+// OP_SET_LOCAL leaves the value on the stack, so the expression is still evaluated and popped as before.
+static int32_t remove_dead_stores(IRFunction* ir) {
+    const Vector<uint8_t>& code = ir->chunk->m_code;
+    uint8_t read[UINT8_MAX + 1] = {};
+    auto read_rk = [&](uint8_t rk) {
+        if (!(rk & RKConstantBit)) read[rk] = 1;
+    };
+    for (const IRInstr& instr : ir->instrs) {
+        if (instr.removed) continue;
+        switch (instr.op) {
+            case OP_GET_LOCAL:
+                read[code[instr.offset + 1]] = 1;
+                break;
+            case OP_CLOSURE:
+                for (int32_t j = instr.offset + 4; j < instr.offset + instr.length; j += 2) {
+                    if (code[j]) read[code[j + 1]] = 1;
+                }
+                break;
+            case OP_R_MOVE:
+                read_rk(code[instr.offset + 2]);
+                break;
+            case OP_R_EQUAL:
+            case OP_R_NOT_EQUAL:
+            case OP_R_GREATER:
+            case OP_R_GREATER_EQUAL:
+            case OP_R_LESS:
+            case OP_R_LESS_EQUAL:
+            case OP_R_ADD:
+            case OP_R_SUBTRACT:
+            case OP_R_MULTIPLY:
+            case OP_R_DIVIDE:
+                read_rk(code[instr.offset + 2]);
+                read_rk(code[instr.offset + 3]);
+                break;
+            default:
+                break;
+        }
+    }
+
+    int32_t changes = 0;
+    for (IRInstr& instr : ir->instrs) {
+        if (instr.removed) continue;
+        // OP_R_MOVE only writes a register here, the compiler never emits it with RegisterPush
+        if ((instr.op == OP_SET_LOCAL || instr.op == OP_R_MOVE) && !read[code[instr.offset + 1]]) {
+            instr.removed = true;
+            changes++;
+        }
+    }
+    return changes;
+}
+
+const Pass g_passes[PassCount] = {
+    {"jumps threaded", OptLevel::O2, thread_jumps},
+    {"unreachable instructions removed", OptLevel::O2, remove_unreachable_code},
+    {"dead stores removed", OptLevel::O2, remove_dead_stores},
+};
+
+void optimize_chunk(Chunk* chunk, OptLevel level, OptimizerStats* stats) {
+    IRFunction ir;
+    bool decoded = false;
+    bool changed = false;
+    for (int32_t i = 0; i < PassCount; i++) {
+        if (level < g_passes[i].level) continue;
+        if (!decoded) {
+            decode(chunk, &ir);
+            decoded = true;
+        }
+        int32_t changes = g_passes[i].run(&ir);
+        stats->changes[i] += changes;
+        changed |= changes > 0;
+    }
+    if (changed) encode(&ir);
+
+    if (level >= OptLevel::O1) peephole_optimize(chunk);
+}
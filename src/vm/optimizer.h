@@ -0,0 +1,44 @@
+#pragma once
+
+#include "vm/chunk.h"
+
+// -O0 compiles straight to bytecode. -O1, the default, folds constants while compiling (see
+// Compiler::trailing_constant()) and runs peephole_optimize() on every chunk. -O2 also runs the IR passes below.
+enum class OptLevel : uint8_t {
+    O0, O1, O2
+};
+
+// A finished chunk decoded into a list of instructions, so passes can remove instructions or retarget jumps
+// without keeping byte offsets up to date. Jumps refer to the instruction they land on by index, the other
+// operands stay in the chunk's code until the IR is encoded back into it.
+struct IRInstr {
+    int32_t offset; // Where the instruction starts in the chunk's code
+    int32_t length;
+    int32_t target; // For jumps, the index of the instruction it lands on; -1 otherwise
+    uint8_t op;
+    bool removed;
+};
+
+struct IRFunction {
+    Chunk* chunk;
+    Vector<IRInstr> instrs;
+};
+
+// A pass returns how many changes it made, which --stats adds up per pass.
+using PassFn = int32_t (*)(IRFunction* ir);
+
+struct Pass {
+    const char* name;
+    OptLevel level; // Lowest level that runs the pass
+    PassFn run;
+};
+
+constexpr int32_t PassCount = 3;
+extern const Pass g_passes[PassCount];
+
+struct OptimizerStats {
+    uint64_t changes[PassCount] = {};
+};
+
+// Runs the passes enabled at level over a finished chunk, in the order of g_passes, then the peephole pass.
+void optimize_chunk(Chunk* chunk, OptLevel level, OptimizerStats* stats);
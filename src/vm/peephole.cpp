@@ -0,0 +1,136 @@
+#include "vm/peephole.h"
+
+#include "vm/object.h"
+
+struct PendingJump {
+    int32_t operand;     // Position of the offset in the new code (always the last operand)
+    int32_t old_target;  // Offset the jump lands on in the old code
+    bool backward;
+    bool wide;           // 24-bit offset instead of 16-bit
+};
+
+// Distance of the jump at offset, counted from the end of the instruction.
+static int32_t old_jump_distance(const Chunk* chunk, int32_t offset) {
+    const Vector<uint8_t>& code = chunk->m_code;
+    if (is_long_jump(code[offset])) {
+        return (code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3];
+    }
+    return (code[offset + 1] << 8) | code[offset + 2];
+}
+
+void peephole_optimize(Chunk* chunk) {
+    const Vector<uint8_t>& code = chunk->m_code;
+    int32_t count = chunk->code_count();
+
+    Vector<uint8_t> is_target(count + 1);
+    for (int32_t i = 0; i <= count; i++) is_target[i] = 0;
+    for (int32_t offset = 0; offset < count; offset += chunk->instruction_length(offset)) {
+        uint8_t instr = code[offset];
+        if (is_jump(instr)) {
+            int32_t target = chunk->jump_target(offset);
+            is_target[target] = 1;
+            // LESS_LOCAL_CONST_JUMP skips the POP a conditional jump lands on
+            if (target < count && code[target] == OP_POP) is_target[target + 1] = 1;
+        }
+    }
+
+    auto no_target_in = [&](int32_t from, int32_t to) {
+        for (int32_t i = from; i < to; i++) {
+            if (is_target[i]) return false;
+        }
+        return true;
+    };
+
+    Vector<uint8_t> new_code;
+    Vector<int32_t> new_lines;
+    Vector<int32_t> new_offsets(count + 1);
+    Vector<PendingJump> jumps;
+    new_code.reserve(count);
+    new_lines.reserve(count);
+
+    int32_t offset = 0;
+    while (offset < count) {
+        new_offsets[offset] = new_code.ssize();
+        int32_t line = chunk->m_lines[offset];
+        auto emit = [&](uint8_t byte) {
+            new_code.push_back(byte);
+            new_lines.push_back(line);
+        };
+
+        int32_t length = chunk->instruction_length(offset);
+        uint8_t instr = code[offset];
+        if (instr == OP_GET_LOCAL && offset + 2 < count) {
+            uint8_t slot = code[offset + 1];
+            uint8_t next = code[offset + 2];
+            if (next == OP_GET_LOCAL && offset + 4 < count && code[offset + 4] == OP_ADD &&
+                no_target_in(offset + 1, offset + 5)) {
+                emit(OP_ADD_LOCAL_LOCAL);
+                emit(slot);
+                emit(code[offset + 3]);
+                offset += 5;
+                continue;
+            }
+            // The compiler only emits the long form of forward jumps, the fused instruction has a 16-bit offset
+            if (next == OP_CONSTANT && offset + 9 < count && code[offset + 4] == OP_LESS &&
+                code[offset + 5] == OP_JUMP_IF_FALSE_LONG && code[offset + 9] == OP_POP &&
+                old_jump_distance(chunk, offset + 5) <= UINT16_MAX && no_target_in(offset + 1, offset + 10)) {
+                int32_t target = chunk->jump_target(offset + 5);
+                if (code[target] == OP_POP) {
+                    emit(OP_LESS_LOCAL_CONST_JUMP);
+                    emit(slot);
+                    emit(code[offset + 3]);
+                    jumps.push_back({new_code.ssize(), target + 1, false, false});
+                    emit(0xff);
+                    emit(0xff);
+                    offset += 10;
+                    continue;
+                }
+            }
+            if (slot == 0 && next == OP_GET_PROPERTY && no_target_in(offset + 1, offset + 3)) {
+                emit(OP_GET_THIS_PROPERTY);
+                for (int32_t i = 3; i < 8; i++) {
+                    emit(code[offset + i]);
+                }
+                offset += 8;
+                continue;
+            }
+        }
+
+        // Code only shrinks here, so a jump whose old distance fits in 16 bits still fits afterwards
+        if ((instr == OP_JUMP_LONG || instr == OP_JUMP_IF_FALSE_LONG) && old_jump_distance(chunk, offset) <= UINT16_MAX) {
+            jumps.push_back({new_code.ssize() + 1, chunk->jump_target(offset), false, false});
+            emit(instr == OP_JUMP_LONG ? OP_JUMP : OP_JUMP_IF_FALSE);
+            emit(0xff);
+            emit(0xff);
+            offset += length;
+            continue;
+        }
+        if (is_jump(instr)) {
+            bool backward = instr == OP_LOOP || instr == OP_LOOP_LONG;
+            jumps.push_back({new_code.ssize() + 1, chunk->jump_target(offset), backward, is_long_jump(instr)});
+        }
+        for (int32_t i = 0; i < length; i++) {
+            emit(code[offset + i]);
+        }
+        offset += length;
+    }
+    new_offsets[count] = new_code.ssize();
+
+    for (const PendingJump& jump : jumps) {
+        int32_t instruction_end = jump.operand + (jump.wide ? 3 : 2);
+        int32_t target = new_offsets[jump.old_target];
+        int32_t distance = jump.backward ? instruction_end - target : target - instruction_end;
+        if (jump.wide) {
+            new_code[jump.operand] = (distance >> 16) & 0xff;
+            new_code[jump.operand + 1] = (distance >> 8) & 0xff;
+            new_code[jump.operand + 2] = distance & 0xff;
+        }
+        else {
+            new_code[jump.operand] = (distance >> 8) & 0xff;
+            new_code[jump.operand + 1] = distance & 0xff;
+        }
+    }
+
+    swap(chunk->m_code, new_code);
+    swap(chunk->m_lines, new_lines);
+}
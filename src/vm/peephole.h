@@ -0,0 +1,11 @@
+#pragma once
+
+#include "vm/chunk.h"
+
+// Peephole pass run on every finished chunk. It fuses common instruction sequences into superinstructions:
+//   GET_LOCAL a, GET_LOCAL b, ADD                          -> ADD_LOCAL_LOCAL a b
+//   GET_LOCAL a, CONSTANT k, LESS, JUMP_IF_FALSE, POP      -> LESS_LOCAL_CONST_JUMP a k (only if the jump lands on a POP)
+//   GET_LOCAL 0, GET_PROPERTY name                         -> GET_THIS_PROPERTY name
+// A sequence is only fused if no jump lands inside it. Jump offsets are rewritten for the shorter code, and forward
+// jumps (which the compiler emits in the 24-bit _LONG form) are shortened to the 16-bit form when they fit.
+void peephole_optimize(Chunk* chunk);
@@ -0,0 +1,42 @@
+#include "vm/shape.h"
+
+static Shape* create_shape(Shape* parent, ObjString* key) {
+    static uint32_t next_shape_id = 1;
+    Shape* shape = new Shape();
+    shape->id = next_shape_id++;
+    shape->slot_count = parent != nullptr ? parent->slot_count + 1 : 0;
+    shape->key = key;
+    shape->parent = parent;
+    return shape;
+}
+
+Shape* create_root_shape() {
+    return create_shape(nullptr, nullptr);
+}
+
+void free_shape_tree(Shape* root, bool release_keys) {
+    for (ShapeTransition& transition : root->transitions) {
+        free_shape_tree(transition.shape, release_keys);
+    }
+    if (release_keys && root->key != nullptr) {
+        Value(root->key).obj_decref();
+    }
+    delete root;
+}
+
+int32_t Shape::find_slot(ObjString* name) const {
+    for (const Shape* shape = this; shape->key != nullptr; shape = shape->parent) {
+        if (shape->key == name) return shape->slot_count - 1;
+    }
+    return -1;
+}
+
+Shape* Shape::add_transition(ObjString* name) {
+    for (ShapeTransition& transition : transitions) {
+        if (transition.key == name) return transition.shape;
+    }
+    Value(name).obj_incref();
+    Shape* shape = create_shape(this, name);
+    transitions.push_back(ShapeTransition{name, shape});
+    return shape;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "core/vector.h"
+
+#include "vm/value.h"
+
+struct Shape;
+
+struct ShapeTransition {
+    ObjString* key;
+    Shape* shape;
+};
+
+// Hidden class describing the field layout of an instance.
+// Each class owns a tree of shapes rooted at an empty shape, where every transition appends one field.
+// Instances that add the same fields in the same order end up sharing a shape,
+// so a field lookup on a shape can be cached as a plain slot index.
+struct Shape {
+    uint32_t id;           // Unique per shape, used as the inline cache key
+    int32_t slot_count;
+    ObjString* key;        // Field added by the transition into this shape (nullptr for the root)
+    Shape* parent;
+    Vector<ShapeTransition> transitions;
+
+    // Returns the slot of the field, or -1 if instances of this shape don't have it.
+    // Field names are interned, so keys are compared by pointer.
+    int32_t find_slot(ObjString* name) const;
+
+    // Returns the shape reached by appending the field, creating it if this is the first time.
+    Shape* add_transition(ObjString* name);
+};
+
+Shape* create_root_shape();
+
+// release_keys is false when the cycle collector frees the tree, the keys may already be gone by then.
+void free_shape_tree(Shape* root, bool release_keys = true);
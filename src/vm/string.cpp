@@ -1,24 +1,79 @@
 #include "vm/string.h"
+#include "vm/string_interner.h"
+#include "vm/gc.h"
+#include "vm/allocator.h"
 
 #include <cstring>
 #include <cstddef>
 #include <cstdlib>
 #include <new>
 
-uint32_t hash_string(const char *key, int32_t length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Multiplies to 128 bits and folds the halves together
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#elif defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32, b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    uint64_t lo = (cross << 32) | (uint32_t)lo_lo;
+    return lo ^ hi;
+#endif
+}
+
+static constexpr uint64_t HashWordMultiplier = 0xe7037ed1a0b428dbull;
+static constexpr uint64_t HashFinishMultiplier = 0x8ebc6af09c88c6e3ull;
+
+uint64_t hash_words(uint64_t state, const char* chars, int32_t word_count) {
+    for (int32_t i = 0; i < word_count; i++) {
+        uint64_t word;
+        memcpy(&word, chars + i * 8, sizeof(word));
+        state = hash_mix(state ^ word, HashWordMultiplier);
     }
-    return hash;
+    return state;
+}
+
+// Reads the 0-7 tail bytes into a word with overlapping loads (the length is hashed too, so that's unambiguous)
+static inline uint64_t read_tail(const char* tail, int32_t count) {
+    if (count >= 4) {
+        uint32_t lo, hi;
+        memcpy(&lo, tail, sizeof(lo));
+        memcpy(&hi, tail + count - 4, sizeof(hi));
+        return ((uint64_t)hi << 32) | lo;
+    }
+    if (count > 0) {
+        return ((uint64_t)(uint8_t)tail[0] << 16) | ((uint64_t)(uint8_t)tail[count >> 1] << 8) | (uint8_t)tail[count - 1];
+    }
+    return 0;
+}
+
+uint32_t hash_finish(uint64_t state, const char* tail, int32_t length) {
+    uint64_t word = read_tail(tail, length & 7);
+    uint64_t hash = hash_mix(state ^ word, HashFinishMultiplier ^ (uint64_t)length);
+    return (uint32_t)hash ^ (uint32_t)(hash >> 32);
+}
+
+uint32_t hash_string(const char *key, int32_t length) {
+    uint64_t state = hash_words(StringHashSeed, key, length / 8);
+    return hash_finish(state, key + (length & ~7), length);
 }
 
 ObjString *allocate_obj_string(int32_t length) {
-    void* raw_data = malloc(offsetof(ObjString, chars[length + 1]));
+    void* raw_data = g_allocator.allocate(OBJ_STRING, obj_string_size(length));
     new (raw_data) ObjString();
     auto str = static_cast<ObjString*>(raw_data);
     str->length = length;
+    g_heap.track(&str->obj);
     return str;
 }
 
@@ -31,8 +86,11 @@ ObjString *create_obj_string(const char *chars, int32_t length) {
 }
 
 void free_obj_string(ObjString* obj_string) {
+    if (obj_string->obj.interned) g_string_interner->remove_string(obj_string);
+    g_heap.untrack(&obj_string->obj);
+    size_t size = obj_string_size(obj_string->length);
     obj_string->~ObjString();
-    free(obj_string);
+    g_allocator.deallocate(OBJ_STRING, obj_string, size);
     obj_string = nullptr;
 }
 
@@ -44,12 +102,122 @@ ObjString* create_obj_string_with_known_hash(const char* chars, int32_t length,
     return str;
 }
 
-ObjString* concat_string(ObjString* a, ObjString* b) {
-    int32_t length = a->length + b->length;
-    auto result = allocate_obj_string(length);
-    memcpy(result->chars, a->chars, a->length);
-    memcpy(result->chars + a->length, b->chars, b->length);
-    result->hash = hash_string(result->chars, length);
-    result->chars[length] = 0;
-    return result;
+void disown_new_string(Obj* obj) {
+    obj->refcount = 0;
+#ifdef LOX_DEFERRED_RC
+    zct_push(obj);
+#endif
+}
+
+static StringBuffer* allocate_string_buffer(int32_t capacity) {
+    auto buffer = static_cast<StringBuffer*>(malloc(offsetof(StringBuffer, chars) + capacity));
+    buffer->refcount = 1;
+    buffer->used = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+void release_string_buffer(StringBuffer* buffer) {
+    if (--buffer->refcount == 0) free(buffer);
+}
+
+static int32_t grow_buffer_capacity(int32_t needed) {
+    int32_t capacity = RopeMinLength * 2;
+    while (capacity < needed) capacity *= 2;
+    return capacity;
+}
+
+const char* rope_chars(const ObjRope* rope) {
+    return rope->flat != nullptr ? rope->flat->chars : rope->buffer->chars;
+}
+
+void string_contents(const Value& value, const char** chars, int32_t* length) {
+    if (value.is_short_string()) {
+        *chars = value.short_string_chars();
+        *length = value.short_string_length();
+    }
+    else if (value.is_rope()) {
+        *chars = rope_chars(value.as_rope());
+        *length = value.as_rope()->length;
+    }
+    else {
+        *chars = value.as_string()->chars;
+        *length = value.as_string()->length;
+    }
+}
+
+// prefix is the rope whose contents the new one starts with, if any
+static ObjRope* create_obj_rope(StringBuffer* buffer, int32_t length, const ObjRope* prefix) {
+    void* raw_data = g_allocator.allocate(OBJ_ROPE, sizeof(ObjRope));
+    new (raw_data) ObjRope();
+    auto rope = static_cast<ObjRope*>(raw_data);
+    rope->length = length;
+    rope->buffer = buffer;
+    rope->flat = nullptr;
+    rope->hashed_words = prefix != nullptr ? prefix->hashed_words : 0;
+    rope->hash_state = prefix != nullptr ? prefix->hash_state : StringHashSeed;
+    g_heap.track(&rope->obj);
+    disown_new_string(&rope->obj);
+    return rope;
+}
+
+ObjRope* concat_rope(Value a, Value b) {
+    const char* a_chars;
+    int32_t a_length;
+    string_contents(a, &a_chars, &a_length);
+    const char* b_chars;
+    int32_t b_length;
+    string_contents(b, &b_chars, &b_length);
+    int32_t length = a_length + b_length;
+
+    if (a.is_rope()) {
+        ObjRope* rope = a.as_rope();
+        StringBuffer* buffer = rope->buffer;
+        if (buffer != nullptr && buffer->used == rope->length) {
+            if (length > buffer->capacity && buffer->refcount == 1) {
+                // Nothing else shares the buffer, so it can move
+                int32_t capacity = grow_buffer_capacity(length);
+                buffer = static_cast<StringBuffer*>(realloc(buffer, offsetof(StringBuffer, chars) + capacity));
+                buffer->capacity = capacity;
+                rope->buffer = buffer;
+                // b may be this same rope (s + s)
+                string_contents(b, &b_chars, &b_length);
+            }
+            if (length <= buffer->capacity) {
+                memcpy(buffer->chars + buffer->used, b_chars, b_length);
+                buffer->used = length;
+                buffer->refcount++;
+                return create_obj_rope(buffer, length, rope);
+            }
+        }
+    }
+
+    StringBuffer* buffer = allocate_string_buffer(grow_buffer_capacity(length));
+    memcpy(buffer->chars, a_chars, a_length);
+    memcpy(buffer->chars + a_length, b_chars, b_length);
+    buffer->used = length;
+    return create_obj_rope(buffer, length, a.is_rope() ? a.as_rope() : nullptr);
+}
+
+ObjString* flatten_rope(ObjRope* rope) {
+    if (rope->flat == nullptr) {
+        const char* chars = rope->buffer->chars;
+        int32_t words = rope->length / 8;
+        rope->hash_state = hash_words(rope->hash_state, chars + rope->hashed_words * 8, words - rope->hashed_words);
+        rope->hashed_words = words;
+        uint32_t hash = hash_finish(rope->hash_state, chars + words * 8, rope->length);
+        rope->flat = g_string_interner->create_string(chars, rope->length, hash);
+        Value(rope->flat).obj_incref();
+        release_string_buffer(rope->buffer);
+        rope->buffer = nullptr;
+    }
+    return rope->flat;
+}
+
+void free_obj_rope(ObjRope* rope) {
+    g_heap.untrack(&rope->obj);
+    if (rope->buffer != nullptr) release_string_buffer(rope->buffer);
+    if (rope->flat != nullptr) Value(rope->flat).obj_decref();
+    rope->~ObjRope();
+    g_allocator.deallocate(OBJ_ROPE, rope, sizeof(ObjRope));
 }
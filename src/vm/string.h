@@ -2,6 +2,8 @@
 
 #include "vm/value.h"
 
+#include <cstddef>
+
 struct ObjString {
     Obj obj = OBJ_STRING;
     int32_t length;
@@ -9,6 +11,20 @@ struct ObjString {
     char chars[];
 };
 
+// Allocation size of a string with the given length (including the null terminator).
+inline size_t obj_string_size(int32_t length) {
+    return offsetof(ObjString, chars) + length + 1;
+}
+
+// Word-at-a-time string hash, a single-lane take on wyhash: every 8-byte word is folded into a 64-bit state with one
+// 64x64->128-bit multiply, and hash_finish() folds in the remaining 0-7 tail bytes and the length.
+// The state only depends on the whole words hashed so far, so a string that extends another one can resume from the
+// prefix's state instead of rescanning it (see ObjRope).
+constexpr uint64_t StringHashSeed = 0xa0761d6478bd642full;
+
+uint64_t hash_words(uint64_t state, const char* chars, int32_t word_count);
+uint32_t hash_finish(uint64_t state, const char* tail, int32_t length);
+
 uint32_t hash_string(const char *key, int32_t length);
 
 ObjString* allocate_obj_string(int32_t length);
@@ -19,4 +35,44 @@ void free_obj_string(ObjString* obj_string);
 
 ObjString* create_obj_string_with_known_hash(const char* chars, int32_t length, uint32_t hash);
 
-ObjString* concat_string(ObjString* a, ObjString* b);
+// Drops the creation reference of a new string or rope: they're handed out unowned, and freed once the first
+// reference taken to them is dropped (see StringInterner).
+void disown_new_string(Obj* obj);
+
+// Character storage shared by ropes. Bytes below used never change, so a rope that ends at used can append
+// in place, and every rope built from it that way just sees a longer prefix of the same buffer.
+struct StringBuffer {
+    int32_t refcount;
+    int32_t used;
+    int32_t capacity;
+    char chars[];
+};
+
+// Concatenations at least this long produce a rope instead of an interned string.
+constexpr int32_t RopeMinLength = 256;
+
+// A string built by concatenation whose flattening into an interned ObjString is deferred until it's used as a
+// table key, compared or used as a format string. Until then appending to it copies only the appended bytes
+// (amortized), and nothing gets hashed. Flattening resumes the hash from the longest prefix hashed so far.
+struct ObjRope {
+    Obj obj = OBJ_ROPE;
+    int32_t length;
+    StringBuffer* buffer;  // Released once flattened
+    ObjString* flat;       // Interned contents, nullptr until flattened
+    int32_t hashed_words;  // Whole words of the contents that hash_state covers
+    uint64_t hash_state;   // hash_words() state, inherited from the rope this one extends
+};
+
+// The contents of a short string, string or rope. For short strings chars points into value.
+void string_contents(const Value& value, const char** chars, int32_t* length);
+
+// Concatenates two strings (of any kind) into a new (unowned) rope.
+ObjRope* concat_rope(Value a, Value b);
+
+ObjString* flatten_rope(ObjRope* rope);
+
+const char* rope_chars(const ObjRope* rope);
+
+void free_obj_rope(ObjRope* rope);
+
+void release_string_buffer(StringBuffer* buffer);
@@ -1,11 +1,21 @@
 #include "vm/string_interner.h"
+#include "vm/gc.h"
+
+StringInterner* g_string_interner = nullptr;
 
 void StringInterner::init() {
     m_strings.init();
+    g_string_interner = this;
 }
 
 void StringInterner::free() {
-    m_strings.clear();
+    // The table doesn't own its keys, strings that are still alive just stop being interned
+    for (int32_t i = 0; i < m_strings.capacity; i++) {
+        if (m_strings.entries[i].key.is_obj()) m_strings.entries[i].key.as_obj()->interned = 0;
+    }
+    ::free(m_strings.entries);
+    m_strings.init();
+    if (g_string_interner == this) g_string_interner = nullptr;
 }
 
 ObjString* StringInterner::create_string(const char *chars, int32_t length) {
@@ -14,15 +24,31 @@ ObjString* StringInterner::create_string(const char *chars, int32_t length) {
 }
 
 ObjString* StringInterner::create_string(const char *chars, int32_t length, uint32_t hash) {
+    stats.lookups++;
     ObjString* interned = m_strings.get_string(chars, length, hash);
     if (interned != nullptr) {
+        stats.hits++;
         return interned;
     }
     else {
         ObjString* new_string = create_obj_string_with_known_hash(chars, length, hash);
-        auto value = Value(new_string);
-        value.obj_incref();
-        m_strings.set(value, Value());
+        new_string->obj.interned = 1;
+        m_strings.set_string_key(new_string, Value());
+        disown_new_string(&new_string->obj);
         return new_string;
     }
 }
+
+Value StringInterner::create_string_value(const char* chars, int32_t length) {
+    if (Value::fits_short_string(chars, length)) {
+        stats.short_strings++;
+        return Value::short_string(chars, length);
+    }
+    return Value(create_string(chars, length));
+}
+
+void StringInterner::remove_string(ObjString* str) {
+    m_strings.erase_string_key(str);
+    str->obj.interned = 0;
+    stats.reclaimed++;
+}
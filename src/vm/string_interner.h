@@ -3,6 +3,16 @@
 #include "vm/string.h"
 #include "vm/table.h"
 
+struct InternerStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t reclaimed = 0;     // Strings removed from the interner because they were freed
+    uint64_t short_strings = 0; // String values stored in the value itself instead of being interned
+};
+
+// Interns every string the VM creates, so equal strings are the same object.
+// The interner only holds weak references: a new string is handed out with a refcount of zero, and it removes
+// itself from the interner when it gets freed (by refcounting or by the cycle collector).
 class StringInterner {
 public:
     void init();
@@ -12,9 +22,20 @@ public:
 
     ObjString* create_string(const char* chars, int32_t length, uint32_t hash);
 
-    void free_string(ObjString* str);
+    // A string for use as a Lox value: short strings aren't interned but stored in the value (see Value::short_string).
+    Value create_string_value(const char* chars, int32_t length);
+
+    // Called when an interned string is freed.
+    void remove_string(ObjString* str);
+
+    int32_t size() const { return m_strings.count; }
+
+    InternerStats stats;
 
 private:
     ObjTable m_strings;
 
-};
\ No newline at end of file
+};
+
+// The interner that interned strings remove themselves from, set by StringInterner::init().
+extern StringInterner* g_string_interner;
@@ -1,156 +1,441 @@
 #include "vm/table.h"
 
 #include "vm/string.h"
+#include "vm/gc.h"
+#include "vm/allocator.h"
 
 #include <new>
 #include <cstring>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOX_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 ObjTable *create_obj_table() {
-    void* raw_data = malloc(sizeof(ObjTable));
+    void* raw_data = g_allocator.allocate(OBJ_TABLE, sizeof(ObjTable));
     new (raw_data) ObjTable();
     ObjTable* table = static_cast<ObjTable*>(raw_data);
     table->init();
+    g_heap.track(&table->obj);
     return table;
 }
 
 void free_obj_table(ObjTable* table) {
+    g_heap.untrack(&table->obj);
     table->clear();
     table->~ObjTable();
-    free(table);
+    g_allocator.deallocate(OBJ_TABLE, table, sizeof(ObjTable));
+}
+
+// Control bytes. Full slots hold the 7-bit hash fragment of their key, so only empty and deleted have the sign bit set.
+static constexpr int8_t CtrlEmpty = -128;
+static constexpr int8_t CtrlDeleted = -2;
+
+// The high bits of the hash pick the first group to probe, the low 7 bits are stored in the control byte.
+static inline uint32_t hash_group(uint32_t hash) { return hash >> 7; }
+static inline int8_t hash_fragment(uint32_t hash) { return (int8_t)(hash & 0x7f); }
+
+static inline int32_t lowest_bit(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int32_t)index;
+#else
+    return __builtin_ctz(mask);
+#endif
 }
 
+// The control bytes of TableGroupSize consecutive slots. The match functions return a bitmask with bit i set if
+// slot i of the group matches.
+struct Group {
+#ifdef LOX_TABLE_SSE2
+    __m128i ctrl;
+
+    explicit Group(const int8_t* pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+    uint32_t match(int8_t fragment) const {
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(fragment), ctrl));
+    }
+    uint32_t match_empty_or_deleted() const {
+        return (uint32_t)_mm_movemask_epi8(ctrl);
+    }
+#else
+    const int8_t* ctrl;
+
+    explicit Group(const int8_t* pos) : ctrl(pos) {}
+
+    uint32_t match(int8_t fragment) const {
+        uint32_t mask = 0;
+        for (int32_t i = 0; i < TableGroupSize; i++) {
+            if (ctrl[i] == fragment) mask |= 1u << i;
+        }
+        return mask;
+    }
+    uint32_t match_empty_or_deleted() const {
+        uint32_t mask = 0;
+        for (int32_t i = 0; i < TableGroupSize; i++) {
+            if (ctrl[i] < 0) mask |= 1u << i;
+        }
+        return mask;
+    }
+#endif
+    uint32_t match_empty() const { return match(CtrlEmpty); }
+};
+
+// Triangular probing over whole groups, which visits every group once since the group count is a power of two.
+struct ProbeSeq {
+    uint32_t mask;
+    uint32_t group;
+    uint32_t stride = 0;
+
+    ProbeSeq(uint32_t hash, int32_t capacity) :
+        mask((uint32_t)(capacity / TableGroupSize) - 1), group(hash_group(hash) & mask) {}
+
+    int32_t offset() const { return (int32_t)(group * TableGroupSize); }
+    void next() {
+        stride++;
+        group = (group + stride) & mask;
+    }
+};
+
 static int32_t grow_capacity(int32_t capacity) {
-    return capacity < 8? 8 : capacity * 2;
+    return capacity < TableGroupSize? TableGroupSize : capacity * 2;
+}
+
+// Max load is 7/8, counting deleted slots. This leaves every probe sequence an empty slot to stop at.
+static inline bool over_max_load(int32_t load, int32_t capacity) {
+    return load > capacity - capacity / 8;
+}
+
+// Smallest capacity that holds count entries at no more than half the max load.
+static int32_t capacity_for(int32_t count) {
+    int32_t capacity = TableGroupSize;
+    while (over_max_load(count * 2, capacity)) capacity *= 2;
+    return capacity;
+}
+
+// Number keys (tables indexed by integer ids are common) skip the generic hash and equality dispatch.
+static inline uint32_t key_hash(Value key) {
+    return key.is_number() ? hash_number(key.as_number()) : key.hash();
+}
+
+static inline bool same_number(Value a, Value b) {
+#ifdef LOX_NAN_BOXING
+    if (a.value == b.value) return true;
+    return (a.is_int() || b.is_int()) && a.is_number() && b.is_number() && a.double_bits() == b.double_bits();
+#else
+    return a.is_number() && a.as_number() == b.as_number();
+#endif
+}
+
+// Returns the index of the full slot whose key satisfies eq, or -1.
+template <typename KeyEq>
+static int32_t find_index(const Entry* entries, const int8_t* ctrl, int32_t capacity, uint32_t hash, KeyEq eq) {
+    ProbeSeq seq(hash, capacity);
+    int8_t fragment = hash_fragment(hash);
+    for (;;) {
+        Group group(ctrl + seq.offset());
+        for (uint32_t match = group.match(fragment); match != 0; match &= match - 1) {
+            int32_t index = seq.offset() + lowest_bit(match);
+            if (eq(entries[index].key)) return index;
+        }
+        if (group.match_empty() != 0) return -1;
+        seq.next();
+    }
+}
+
+static int32_t find_key(const ObjTable* table, Value key, uint32_t hash) {
+    if (key.is_number()) {
+        return find_index(table->entries, table->ctrl, table->capacity, hash,
+                          [key](Value other) { return same_number(other, key); });
+    }
+    return find_index(table->entries, table->ctrl, table->capacity, hash,
+                      [key](Value other) { return Value::equals(other, key); });
+}
+
+// Interned strings are equal only if they're the same object.
+static int32_t find_string_key(const ObjTable* table, ObjString* key) {
+    return find_index(table->entries, table->ctrl, table->capacity, key->hash,
+                      [key](Value other) { return other.is_obj() && other.as_obj() == &key->obj; });
+}
+
+// Returns the first empty or deleted slot on the probe sequence of the hash.
+static int32_t find_insert_index(const int8_t* ctrl, int32_t capacity, uint32_t hash) {
+    ProbeSeq seq(hash, capacity);
+    for (;;) {
+        uint32_t match = Group(ctrl + seq.offset()).match_empty_or_deleted();
+        if (match != 0) return seq.offset() + lowest_bit(match);
+        seq.next();
+    }
+}
+
+static void allocate_storage(int32_t capacity, Entry** entries, int8_t** ctrl) {
+    auto data = static_cast<char*>(malloc((sizeof(Entry) + 1) * capacity));
+    *entries = reinterpret_cast<Entry*>(data);
+    *ctrl = reinterpret_cast<int8_t*>(data + sizeof(Entry) * capacity);
+    for (int32_t i = 0; i < capacity; i++) {
+        (*entries)[i].key = Value();
+        (*entries)[i].value = Value();
+    }
+    memset(*ctrl, CtrlEmpty, capacity);
 }
 
 void ObjTable::init() {
     count = 0;
+    tombstones = 0;
     capacity = 0;
     entries = nullptr;
+    ctrl = nullptr;
 }
 
 void ObjTable::clear() {
     for (int32_t i = 0; i < capacity; i++) {
+        if (ctrl[i] < 0) continue;
         Entry* entry = &entries[i];
-        if (!entry->key.is_nil()) {
-            if (entry->key.is_obj()) entry->key.obj_decref();
-            if (entry->value.is_obj()) entry->value.obj_decref();
-        }
+        if (entry->key.is_obj()) entry->key.obj_decref();
+        if (entry->value.is_obj()) entry->value.obj_decref();
     }
     free(entries);
     init();
 }
 
-static Entry* find_entry(Entry* entries, int32_t capacity, Value key) {
-    uint32_t index = key.hash() & (capacity - 1);
-    Entry* tombstone = nullptr;
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key.is_nil()) {
-            if (entry->value.is_nil()) {
-                return tombstone != nullptr ? tombstone : entry;
-            }
-            else {
-                if (tombstone == nullptr) tombstone = entry;
-            }
-        }
-        else if (Value::equals(entry->key, key)) {
-            return entry;
-        }
-        index = (index + 1) & (capacity - 1);
-    }
+bool ObjTable::get(Value key, Value *value) const {
+    if (count == 0) return false;
+    int32_t index = find_key(this, key, key_hash(key));
+    if (index < 0) return false;
+
+    *value = entries[index].value;
+    return true;
 }
 
-bool ObjTable::get(Value key, Value *value) const {
+bool ObjTable::get_string_key(ObjString* key, Value* value) const {
     if (count == 0) return false;
-    Entry* entry = find_entry(entries, capacity, key);
-    if (entry->key.is_nil()) return false;
+    int32_t index = find_string_key(this, key);
+    if (index < 0) return false;
 
-    *value = entry->value;
+    *value = entries[index].value;
     return true;
 }
 
 static void adjust_capacity(ObjTable* table, int32_t capacity) {
-    Entry* entries = static_cast<Entry*>(malloc(sizeof(Entry) * capacity));
-    for (int32_t i = 0; i < capacity; i++) {
-        entries[i].key = Value();
-        entries[i].value = Value();
-    }
+    Entry* entries;
+    int8_t* ctrl;
+    allocate_storage(capacity, &entries, &ctrl);
 
-    table->count = 0;
+    // Deleted slots are dropped here
     for (int32_t i = 0; i < table->capacity; i++) {
+        if (table->ctrl[i] < 0) continue;
         Entry* entry = &table->entries[i];
-        if (entry->key.is_nil()) continue;
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        uint32_t hash = key_hash(entry->key);
+        int32_t dest = find_insert_index(ctrl, capacity, hash);
+        ctrl[dest] = hash_fragment(hash);
+        entries[dest] = *entry;
     }
 
     free(table->entries);
     table->entries = entries;
+    table->ctrl = ctrl;
     table->capacity = capacity;
+    table->tombstones = 0;
 }
 
-bool ObjTable::set(Value key, Value value) {
-    if (count + 1 > capacity * 3 / 4) {
-        int32_t new_capacity = grow_capacity(capacity);
-        adjust_capacity(this, new_capacity);
-    }
-    Entry* entry = find_entry(entries, capacity, key);
-    bool is_new_key = entry->key.is_nil();
-    if (is_new_key) {
-        entry->key = key;
-        count++;
+// Rehashes the table into its own storage, turning all tombstones back into empty slots.
+// Every full slot is first marked deleted, meaning "not placed yet", and every non-full slot empty. Then each entry
+// is placed at the first free slot of its probe sequence: it stays put if that's in its own group, moves if the
+// slot is empty, and is swapped with the entry there (which is then placed next) if the slot is also unplaced.
+static void drop_tombstones(ObjTable* table) {
+    int8_t* ctrl = table->ctrl;
+    Entry* entries = table->entries;
+    int32_t capacity = table->capacity;
+    for (int32_t i = 0; i < capacity; i++) {
+        ctrl[i] = ctrl[i] < 0 ? CtrlEmpty : CtrlDeleted;
     }
-    else {
-        if (entry->value.is_obj()) entry->value.obj_decref();
+
+    for (int32_t i = 0; i < capacity; i++) {
+        if (ctrl[i] != CtrlDeleted) continue;
+
+        uint32_t hash = key_hash(entries[i].key);
+        int32_t dest = find_insert_index(ctrl, capacity, hash);
+        if (dest / TableGroupSize == i / TableGroupSize) {
+            ctrl[i] = hash_fragment(hash);
+        }
+        else if (ctrl[dest] == CtrlEmpty) {
+            ctrl[dest] = hash_fragment(hash);
+            entries[dest] = entries[i];
+            ctrl[i] = CtrlEmpty;
+            entries[i].key = Value();
+            entries[i].value = Value();
+        }
+        else {
+            ctrl[dest] = hash_fragment(hash);
+            Entry unplaced = entries[dest];
+            entries[dest] = entries[i];
+            entries[i] = unplaced;
+            i--;
+        }
     }
+    table->tombstones = 0;
+}
+
+static void replace_value(Entry* entry, Value value) {
+    if (entry->value.is_obj()) entry->value.obj_decref();
     entry->value = value;
-    return is_new_key;
+}
+
+// Stores a key that isn't in the table yet, growing or rehashing the table first if needed.
+static void insert_new_key(ObjTable* table, Value key, uint32_t hash, Value value) {
+    int32_t index = table->capacity == 0 ? -1 : find_insert_index(table->ctrl, table->capacity, hash);
+    // Reusing a deleted slot doesn't change the load
+    if (index < 0 || (table->ctrl[index] == CtrlEmpty &&
+                      over_max_load(table->count + table->tombstones + 1, table->capacity))) {
+        if (table->capacity > 0 && !over_max_load((table->count + 1) * 2, table->capacity)) {
+            drop_tombstones(table);
+        }
+        else {
+            adjust_capacity(table, grow_capacity(table->capacity));
+        }
+        index = find_insert_index(table->ctrl, table->capacity, hash);
+    }
+    if (table->ctrl[index] == CtrlDeleted) table->tombstones--;
+    table->count++;
+    table->ctrl[index] = hash_fragment(hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+}
+
+bool ObjTable::set(Value key, Value value) {
+    uint32_t hash = key_hash(key);
+    int32_t index = count > 0 ? find_key(this, key, hash) : -1;
+    if (index >= 0) {
+        replace_value(&entries[index], value);
+        return false;
+    }
+    insert_new_key(this, key, hash, value);
+    return true;
+}
+
+bool ObjTable::set_string_key(ObjString* key, Value value) {
+    int32_t index = count > 0 ? find_string_key(this, key) : -1;
+    if (index >= 0) {
+        replace_value(&entries[index], value);
+        return false;
+    }
+    insert_new_key(this, Value(key), key->hash, value);
+    return true;
 }
 
 ObjString *ObjTable::get_string(const char *chars, int32_t length, uint32_t hash) {
     if (count == 0) return nullptr;
 
-    uint32_t index = hash & (capacity - 1);
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key.is_nil()) {
-            if (entry->value.is_nil()) return nullptr;
-        }
-        else if (entry->key.is_string()) {
-            auto key = entry->key.as_string();
-            if (key->length == length &&
-                key->hash == hash &&
-                memcmp(key->chars, chars, length) == 0) {
-                return key;
-            }
-        }
-        index = (index + 1) & (capacity - 1);
+    int32_t index = find_index(entries, ctrl, capacity, hash, [=](Value other) {
+        if (!other.is_string()) return false;
+        auto key = other.as_string();
+        return key->length == length &&
+               key->hash == hash &&
+               memcmp(key->chars, chars, length) == 0;
+    });
+    return index < 0 ? nullptr : entries[index].key.as_string();
+}
+
+static void remove_at(ObjTable* table, int32_t index) {
+    int8_t* ctrl = table->ctrl;
+    Entry* entry = &table->entries[index];
+    entry->key = Value();
+    entry->value = Value();
+
+    // A group that still has an empty slot never had a probe sequence go past it (a group that fills up can't get
+    // an empty slot back before the next rehash), so the slot can become empty again instead of a tombstone.
+    int32_t group_start = index & ~(TableGroupSize - 1);
+    if (Group(ctrl + group_start).match_empty() != 0) {
+        ctrl[index] = CtrlEmpty;
+    }
+    else {
+        ctrl[index] = CtrlDeleted;
+        table->tombstones++;
+    }
+    table->count--;
+
+    if (table->capacity > TableGroupSize && table->count < table->capacity / 8) {
+        adjust_capacity(table, capacity_for(table->count));
     }
 }
 
 bool ObjTable::remove(Value key) {
     if (count == 0) return false;
 
-    Entry* entry = find_entry(entries, capacity, key);
-    if (entry->key.is_nil()) return false;
+    int32_t index = find_key(this, key, key_hash(key));
+    if (index < 0) return false;
 
-    if (entry->key.is_obj()) entry->key.obj_decref();
-    if (entry->value.is_obj()) entry->value.obj_decref();
+    // Released after the entry is gone, in case that frees something that uses the table
+    Entry removed = entries[index];
+    remove_at(this, index);
+    if (removed.key.is_obj()) removed.key.obj_decref();
+    if (removed.value.is_obj()) removed.value.obj_decref();
+    return true;
+}
 
-    entry->key = Value();
-    entry->value = Value(true); // tombstone
+bool ObjTable::erase_string_key(ObjString* key) {
+    if (count == 0) return false;
+
+    int32_t index = find_string_key(this, key);
+    if (index < 0) return false;
+
+    remove_at(this, index);
     return true;
 }
 
+void ObjTable::reserve(int32_t count_) {
+    int32_t new_capacity = TableGroupSize;
+    while (over_max_load(count_, new_capacity)) new_capacity *= 2;
+    if (new_capacity > capacity) {
+        adjust_capacity(this, new_capacity);
+    }
+}
+
+ObjTable* create_obj_table_from_layout(const ObjTable* layout, Value* values, int32_t value_count) {
+    ObjTable* table = create_obj_table();
+    // The layout has no tombstones, and its storage is entries followed by control bytes in one allocation
+    size_t size = (sizeof(Entry) + 1) * (size_t)layout->capacity;
+    auto data = static_cast<char*>(malloc(size));
+    memcpy(data, layout->entries, size);
+    table->entries = reinterpret_cast<Entry*>(data);
+    table->ctrl = reinterpret_cast<int8_t*>(data + sizeof(Entry) * layout->capacity);
+    table->capacity = layout->capacity;
+    table->count = layout->count;
+
+    for (int32_t i = 0; i < table->capacity; i++) {
+        if (table->ctrl[i] < 0) continue;
+        Entry* entry = &table->entries[i];
+        if (entry->key.is_obj()) entry->key.obj_incref();
+        entry->value = values[entry->value.as_int()];
+    }
+
+    // A key repeated in the literal maps to its last value, the earlier ones are dropped
+    if (layout->count != value_count) {
+        for (int32_t v = 0; v < value_count; v++) {
+            if (!values[v].is_obj()) continue;
+            bool used = false;
+            for (int32_t i = 0; i < layout->capacity && !used; i++) {
+                used = layout->ctrl[i] >= 0 && layout->entries[i].value.as_int() == v;
+            }
+            if (!used) values[v].obj_decref();
+        }
+    }
+    return table;
+}
+
 void ObjTable::add_all(ObjTable *from, ObjTable *to) {
     for (int32_t i = 0; i < from->capacity; i++) {
+        if (from->ctrl[i] < 0) continue;
         Entry* entry = &from->entries[i];
-        if (!entry->key.is_nil()) {
-            to->set(entry->key, entry->value);
-        }
+        // Both tables own their entries
+        if (to->set(entry->key, entry->value) && entry->key.is_obj()) entry->key.obj_incref();
+        if (entry->value.is_obj()) entry->value.obj_incref();
     }
 }
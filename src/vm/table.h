@@ -7,11 +7,25 @@ struct Entry {
     Value value;
 };
 
+// Open-addressing hash table in the style of a Swiss table.
+// Next to the entries there's one control byte per slot: empty, deleted, or the low 7 bits of the key's hash
+// (its "fragment") if the slot is full. Lookups probe groups of TableGroupSize control bytes at once
+// (with SSE2 where available) and only compare the keys of slots whose fragment matches.
+// The control bytes live in the same allocation as the entries, right after them, so entries is still the only
+// pointer to free. Slots that aren't full always have a nil key and value, so the entries can be iterated without
+// looking at the control bytes.
+// The load (full plus deleted slots) is kept under 7/8. When an insert would go over it, the table is rehashed in
+// place if tombstones make up most of the load, and grown otherwise. Removes shrink the table once it's less than
+// 1/8 full.
+constexpr int32_t TableGroupSize = 16;
+
 struct ObjTable {
     Obj obj = OBJ_TABLE;
-    int32_t count;
-    int32_t capacity;
+    int32_t count;      // Full slots
+    int32_t tombstones; // Deleted slots, which still lengthen probe sequences until the next rehash
+    int32_t capacity;   // Zero or a power of two that's at least TableGroupSize
     Entry* entries;
+    int8_t* ctrl;
 
     void init();
     void clear();
@@ -19,13 +33,29 @@ struct ObjTable {
     bool get(Value key, Value* value) const;
     bool set(Value key, Value value);
 
+    // For keys that are interned strings (globals, methods): uses the cached hash and compares keys by pointer.
+    bool get_string_key(ObjString* key, Value* value) const;
+    bool set_string_key(ObjString* key, Value value);
+
     ObjString* get_string(const char* chars, int32_t length, uint32_t hash);
 
     bool remove(Value key);
 
+    // Removes the key without releasing the table's references to the key and value,
+    // for tables that hold weak references (the string interner).
+    bool erase_string_key(ObjString* key);
+
+    // Grows the table so that it holds count keys without growing again.
+    void reserve(int32_t count);
+
     static void add_all(ObjTable* from, ObjTable* to);
 };
 
 ObjTable* create_obj_table();
 
+// Creates a table with the same keys and capacity as layout, which maps each key to the index of its value in
+// values (see Compiler::table()), by copying the layout's storage instead of inserting the keys one by one.
+// Takes over the references to the values, releasing the ones that no key maps to.
+ObjTable* create_obj_table_from_layout(const ObjTable* layout, Value* values, int32_t value_count);
+
 void free_obj_table(ObjTable* table);
@@ -50,6 +50,10 @@ void Value::obj_free() {
             free_obj_bound_method(reinterpret_cast<ObjBoundMethod*>(obj));
             break;
         }
+        case OBJ_ROPE: {
+            free_obj_rope(reinterpret_cast<ObjRope*>(obj));
+            break;
+        }
     }
     // Zero-out the pointer for some safety
     value = (QNAN | SIGN_BIT);
@@ -60,35 +64,39 @@ uint32_t Value::hash() const {
     if (is_nil()) return 0;
     else if (is_bool()) return as_bool()? 1231 : 1237;
     else if (is_number()) {
-        double number = as_number();
-        auto bits = reinterpret_cast<const char*>(&number);
-        return hash_string(bits, 4);
+        return hash_number(as_number());
+    }
+    else if (is_short_string()) {
+        return hash_string(short_string_chars(), short_string_length());
     }
     else if (is_obj()) {
         Obj* obj = as_obj();
         if (obj->type == OBJ_STRING) {
             return reinterpret_cast<ObjString*>(obj)->hash;
         }
+        else if (obj->type == OBJ_ROPE) {
+            return flatten_rope(reinterpret_cast<ObjRope*>(obj))->hash;
+        }
         else {
-            auto bits = reinterpret_cast<const char *>(&obj);
-            return hash_string(bits, 4);
+            return hash_uint64((uint64_t)(uintptr_t)obj);
         }
     }
 #else
     switch (type) {
         case VAL_NIL: return 0;
+        case VAL_UNDEFINED: return 0;
         case VAL_BOOL: return as.boolean? 1231 : 1237;
-        case VAL_NUMBER: {
-            auto bits = reinterpret_cast<const char*>(&as.number);
-            return hash_string(bits, 4);
-        }
+        case VAL_NUMBER: return hash_number(as.number);
+        case VAL_SHORT_STRING: return hash_string(short_string_chars(), short_string_length());
         case VAL_OBJ: {
             if (as.obj->type == OBJ_STRING) {
                 return reinterpret_cast<ObjString *>(as.obj)->hash;
             }
+            else if (as.obj->type == OBJ_ROPE) {
+                return flatten_rope(reinterpret_cast<ObjRope*>(as.obj))->hash;
+            }
             else {
-                auto bits = reinterpret_cast<const char *>(&as.obj);
-                return hash_string(bits, 4);
+                return hash_uint64((uint64_t)(uintptr_t)as.obj);
             }
         }
     }
@@ -96,16 +104,27 @@ uint32_t Value::hash() const {
     return 0;
 }
 
+// Strings are interned, so a rope is equal to a string (or another rope) if its flattened contents are the same object.
+static bool rope_equals(Value a, Value b) {
+    if (!(a.is_string() || a.is_rope()) || !(b.is_string() || b.is_rope())) return false;
+    ObjString* a_str = a.is_rope() ? flatten_rope(a.as_rope()) : a.as_string();
+    ObjString* b_str = b.is_rope() ? flatten_rope(b.as_rope()) : b.as_string();
+    return a_str == b_str;
+}
+
 bool Value::equals(const Value &a, const Value &b) {
 #ifdef LOX_NAN_BOXING
-    return a.value == b.value;
+    if (a.value == b.value) return true;
+    if ((a.is_int() || b.is_int()) && a.is_number() && b.is_number()) return a.double_bits() == b.double_bits();
+    return (a.is_rope() || b.is_rope()) && rope_equals(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return a.as_bool() == b.as_bool();
         case VAL_NIL:    return true;
         case VAL_NUMBER: return a.as_number() == b.as_number();
-        case VAL_OBJ:    return a.as_obj() == b.as_obj();
+        case VAL_SHORT_STRING: return a.short_string_bits() == b.short_string_bits();
+        case VAL_OBJ:    return a.as_obj() == b.as_obj() || ((a.is_rope() || b.is_rope()) && rope_equals(a, b));
         default:         return false;
     }
 #endif
@@ -117,6 +136,7 @@ std::string value_to_string(Value value, bool print_refcount) {
     if (value.is_bool()) return value.as_bool()? "true" : "false";
     else if (value.is_nil()) return "nil";
     else if (value.is_number()) return fmt::format("{:g}", value.as_number());
+    else if (value.is_short_string()) return std::string(value.short_string_chars(), value.short_string_length());
     else if (value.is_obj()) {
         if (print_refcount)
             return fmt::format("{} ({})", object_to_string(value, true), value.as_obj()->refcount);
@@ -140,6 +160,7 @@ std::string object_to_string(Value value, bool print_refcount) {
     Obj* obj = value.as_obj();
     switch (obj->type) {
         case OBJ_STRING: return value.as_string()->chars;
+        case OBJ_ROPE: return std::string(rope_chars(value.as_rope()), value.as_rope()->length);
         case OBJ_UPVALUE: {
             return "upvalue";
         }
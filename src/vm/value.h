@@ -1,17 +1,28 @@
 #pragma once
 
 #include <cstdint>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <type_traits>
 #include <string>
 
 #define LOX_NAN_BOXING
 
+// Branch hint for the fast paths of the interpreter loop, so they're laid out in line with the dispatch.
+#ifdef __GNUC__
+#define LOX_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define LOX_LIKELY(x) (x)
+#endif
+
 enum ValueType {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED,
+    VAL_SHORT_STRING
 };
 
 enum ObjType {
@@ -24,7 +35,8 @@ enum ObjType {
     OBJ_NATIVEFUN,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_BOUND_METHOD
+    OBJ_BOUND_METHOD,
+    OBJ_ROPE
 };
 
 // https://en.wikipedia.org/wiki/Xorshift
@@ -39,14 +51,46 @@ inline uint32_t gen_random_uid() {
     return state = x;
 }
 
+// Finalizer of MurmurHash3 (fmix64), folded to 32 bits.
+// Used for numbers and pointers, whose interesting bits are spread over all 64 (integral doubles only differ in
+// the exponent and the top of the mantissa, pointers in the middle bits).
+inline uint32_t hash_uint64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (uint32_t)x ^ (uint32_t)(x >> 32);
+}
+
+inline uint32_t hash_number(double number) {
+    // -0.0 and 0.0 compare equal, so they have to hash the same
+    number += 0.0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hash_uint64(bits);
+}
+
 struct Obj {
     ObjType type : 5;
-    uint32_t uid : 27; // TODO: make this 64-bit?
+    uint32_t marked : 1; // Used by the cycle collector
+    uint32_t in_zct : 1; // Queued in the zero count table (LOX_DEFERRED_RC only)
+    uint32_t interned : 1; // A string owned by the string interner's table (see vm/string_interner.h)
+    uint32_t uid : 24; // TODO: make this 64-bit?
     uint32_t refcount; // TODO: make this atomic
 
-    Obj(ObjType type_) : type(type_), uid(gen_random_uid()), refcount(1) {}
+    // Intrusive list of every heap object, walked by the cycle collector (see vm/gc.h)
+    Obj* gc_prev = nullptr;
+    Obj* gc_next = nullptr;
+
+    Obj(ObjType type_) : type(type_), marked(0), in_zct(0), interned(0), uid(gen_random_uid()), refcount(1) {}
 };
 
+#ifdef LOX_DEFERRED_RC
+// Queues an object whose refcount dropped to zero, see Heap::process_zct().
+void zct_push(Obj* obj);
+#endif
+
 struct ObjString;
 struct ObjArray;
 struct ObjTable;
@@ -56,6 +100,7 @@ struct ObjNativeFun;
 struct ObjClass;
 struct ObjInstance;
 struct ObjBoundMethod;
+struct ObjRope;
 
 struct Value {
 
@@ -66,10 +111,17 @@ struct Value {
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+// Short strings keep their bytes in the low 48 bits, so they're tagged with a bit above them
+#define TAG_SHORT_STRING ((uint64_t)1 << 49)
+#define SHORT_STRING_BITS ((uint64_t)0x0000ffffffffffff)
+// Small integers keep their 32 bits in the low half
+#define TAG_INT ((uint64_t)1 << 48)
 
 #define NIL_VAL         ((uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL       ((uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((uint64_t)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL   ((uint64_t)(QNAN | TAG_UNDEFINED))
 
     uint64_t value;
 
@@ -86,26 +138,62 @@ struct Value {
         value = SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj);
     }
 
+    // Placeholder for a global slot that was resolved but hasn't been defined yet, never visible to Lox code.
+    static Value undefined() {
+        Value v;
+        v.value = UNDEFINED_VAL;
+        return v;
+    }
+
     bool is_bool() const { return (value | 1) == TRUE_VAL; }
     bool is_nil() const { return value == NIL_VAL; }
-    bool is_number() const { return (value & QNAN) != QNAN; }
+    bool is_undefined() const { return value == UNDEFINED_VAL; }
+    bool is_number() const { return is_double() || is_int(); }
+    bool is_double() const { return (value & QNAN) != QNAN; }
+    bool is_int() const { return (value & (SIGN_BIT | QNAN | TAG_SHORT_STRING | TAG_INT)) == (QNAN | TAG_INT); }
     bool is_obj() const { return (value & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
     bool is_obj_type(ObjType type) const { return is_obj() && as_obj()->type == type; }
+    bool is_short_string() const { return (value & (SIGN_BIT | QNAN | TAG_SHORT_STRING)) == (QNAN | TAG_SHORT_STRING); }
 
     bool as_bool() const { return value == TRUE_VAL; }
     double as_number() const {
+        if (is_int()) return (double)as_int();
+        return as_double();
+    }
+    double as_double() const {
         double num;
         memcpy(&num, &value, sizeof(Value));
         return num;
     }
+    int32_t as_int() const { return (int32_t)(uint32_t)value; }
+    // The bits of a number stored as a double, which is how numbers compare: an int and a double holding the same
+    // number are equal, and 0 and -0 aren't, as before ints existed.
+    uint64_t double_bits() const { return is_int() ? Value((double)as_int()).value : value; }
     Obj* as_obj() const { return (Obj*)(uintptr_t)(value & ~(SIGN_BIT | QNAN)); }
 
+    static Value integer(int32_t number) {
+        Value v;
+        v.value = QNAN | TAG_INT | (uint32_t)number;
+        return v;
+    }
+
+    static Value short_string(const char* chars, int32_t length) {
+        Value v;
+        uint64_t bits = 0;
+        memcpy(&bits, chars, length);
+        v.value = QNAN | TAG_SHORT_STRING | bits;
+        return v;
+    }
+    uint64_t short_string_bits() const { return value & SHORT_STRING_BITS; }
+    const char* short_string_chars() const { return reinterpret_cast<const char*>(&value); }
+
 #else
     ValueType type;
     union {
         bool boolean;
         double number;
         Obj* obj;
+        uint64_t short_string;
     } as;
 
     Value() : type(VAL_NIL) {}
@@ -117,18 +205,80 @@ struct Value {
     explicit Value(double number) : type(VAL_NUMBER) { as.number = number; }
     explicit Value(Obj* obj) : type(VAL_OBJ) { as.obj = obj; }
 
+    static Value undefined() {
+        Value v;
+        v.type = VAL_UNDEFINED;
+        return v;
+    }
+
     bool is_bool() const { return type == VAL_BOOL; }
     bool is_nil() const { return type == VAL_NIL; }
+    bool is_undefined() const { return type == VAL_UNDEFINED; }
     bool is_number() const { return type == VAL_NUMBER; }
+    bool is_double() const { return type == VAL_NUMBER; }
     bool is_obj() const { return type == VAL_OBJ; }
     bool is_obj_type(ObjType type) const { return is_obj() && as_obj()->type == type; }
+    bool is_short_string() const { return type == VAL_SHORT_STRING; }
+    bool is_int() const { return false; }
 
     bool as_bool() const { return as.boolean; }
     double as_number() const { return as.number; }
+    double as_double() const { return as.number; }
+    int32_t as_int() const { return (int32_t)as.number; }
     Obj* as_obj() const { return as.obj; }
 
+    static Value integer(int32_t number) { return Value((double)number); }
+
+    static Value short_string(const char* chars, int32_t length) {
+        Value v;
+        v.type = VAL_SHORT_STRING;
+        v.as.short_string = 0;
+        memcpy(&v.as.short_string, chars, length);
+        return v;
+    }
+    uint64_t short_string_bits() const { return as.short_string; }
+    const char* short_string_chars() const { return reinterpret_cast<const char*>(&as.short_string); }
+
 #endif
 
+    // Numbers are doubles, except that with NaN boxing integers that fit in 32 bits can also be stored unboxed
+    // (Value::integer), which integer arithmetic (see VM::run) and array indexing use without going through doubles.
+    // Both are numbers and as_number() works on either, but the same number can be an int or a double, so
+    // comparing numbers goes through double_bits() and hashing through as_number() when the representations differ.
+    // is_double() and as_double() only cover the double representation, for code that has already split the two.
+
+    // An integer result, promoted to a double if it doesn't fit in 32 bits.
+    static Value int_or_double(int64_t number) {
+        if (LOX_LIKELY((int32_t)number == number)) return integer((int32_t)number);
+        return Value((double)number);
+    }
+
+    // A number, unboxed if it's an integer that fits (and not -0).
+    static Value number(double number) {
+        if (number >= INT32_MIN && number <= INT32_MAX && number == (double)(int32_t)number &&
+            (number != 0 || !std::signbit(number))) {
+            return integer((int32_t)number);
+        }
+        return Value(number);
+    }
+
+    // Strings of up to ShortStringMax bytes are stored in the value itself, zero-padded (so they can't contain
+    // NULs), instead of being interned: no allocation, no refcounting, and equal strings are equal bit patterns.
+    // Every string value that fits is short (see StringInterner::create_string_value), interned ObjStrings this
+    // short only show up as names (globals, fields, methods), which never become values.
+    // short_string_chars() points into the value (assuming a little-endian target) and isn't null-terminated.
+    static constexpr int32_t ShortStringMax = 6;
+
+    static bool fits_short_string(const char* chars, int32_t length) {
+        return length <= ShortStringMax && memchr(chars, 0, length) == nullptr;
+    }
+
+    int32_t short_string_length() const {
+        int32_t length = 0;
+        for (uint64_t bits = short_string_bits(); bits != 0; bits >>= 8) length++;
+        return length;
+    }
+
     explicit Value(ObjString* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
     explicit Value(ObjArray* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
     explicit Value(ObjTable* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
@@ -138,6 +288,7 @@ struct Value {
     explicit Value(ObjClass* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
     explicit Value(ObjInstance* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
     explicit Value(ObjBoundMethod* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
+    explicit Value(ObjRope* obj) : Value(reinterpret_cast<Obj*>(obj)) {}
 
     bool is_string() const { return is_obj_type(OBJ_STRING); }
     bool is_array() const { return is_obj_type(OBJ_ARRAY); }
@@ -148,6 +299,8 @@ struct Value {
     bool is_class() const { return is_obj_type(OBJ_CLASS); }
     bool is_instance() const { return is_obj_type(OBJ_INSTANCE); }
     bool is_bound_method() const { return is_obj_type(OBJ_BOUND_METHOD); }
+    bool is_rope() const { return is_obj_type(OBJ_ROPE); }
+    bool is_any_string() const { return is_short_string() || is_string() || is_rope(); }
 
     ObjString* as_string() const { return reinterpret_cast<ObjString*>(as_obj()); }
     ObjArray* as_array() const { return reinterpret_cast<ObjArray*>(as_obj()); }
@@ -158,6 +311,7 @@ struct Value {
     ObjClass* as_class() const { return reinterpret_cast<ObjClass*>(as_obj()); }
     ObjInstance* as_instance() const { return reinterpret_cast<ObjInstance*>(as_obj()); }
     ObjBoundMethod* as_bound_method() const { return reinterpret_cast<ObjBoundMethod*>(as_obj()); }
+    ObjRope* as_rope() const { return reinterpret_cast<ObjRope*>(as_obj()); }
 
     ObjType obj_type() const { return as_obj()->type; }
 
@@ -173,11 +327,46 @@ struct Value {
         Obj* obj = as_obj();
         obj->refcount--;
         if (obj->refcount == 0) {
+#ifdef LOX_DEFERRED_RC
+            // The stack may still point at it, so it can only be freed at the next safepoint.
+            zct_push(obj);
+#else
             obj_free();
             // After this, the Value is in an invalid state, don't use it!
+#endif
         }
     }
 
+    // Reference counting for references held by the VM value stack.
+    // With LOX_DEFERRED_RC the stack doesn't own references at all: objects dropping to zero are queued in
+    // the zero count table, and VM::reconcile_stack() frees the ones the stack doesn't point to at safepoints.
+    void stack_incref() {
+#ifndef LOX_DEFERRED_RC
+        if (is_obj()) obj_incref();
+#endif
+    }
+
+    void stack_decref() {
+#ifndef LOX_DEFERRED_RC
+        if (is_obj()) obj_decref();
+#endif
+    }
+
+    // A value popped off the stack and moved into a heap slot (field, global, table entry, closed upvalue).
+    // Without deferred RC the stack's reference is simply handed over.
+    void stack_to_heap() {
+#ifdef LOX_DEFERRED_RC
+        if (is_obj()) obj_incref();
+#endif
+    }
+
+    // A new object (created with a refcount of 1) whose only reference is the stack slot it's pushed to.
+    void stack_adopt() {
+#ifdef LOX_DEFERRED_RC
+        obj_decref();
+#endif
+    }
+
     void obj_free();
 
     uint32_t hash() const;
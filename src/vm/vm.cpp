@@ -7,6 +7,13 @@
 #include "vm/table.h"
 #include "vm/object.h"
 #include "vm/format.h"
+#include "vm/gc.h"
+#include "vm/allocator.h"
+
+// Labels-as-values is a GCC/Clang extension, fall back to the switch everywhere else.
+#if defined(LOX_COMPUTED_GOTO) && !defined(__GNUC__)
+#undef LOX_COMPUTED_GOTO
+#endif
 
 VM::VM() {
     m_stack_top = m_stack.data();
@@ -14,13 +21,18 @@ VM::VM() {
     m_globals.init();
 
     m_init_string = m_string_interner.create_string("init", 4);
+    Value(m_init_string).obj_incref();
 
     init_builtin_functions();
 }
 
 VM::~VM() {
+    Value(m_init_string).obj_decref();
     m_string_interner.free();
     m_globals.clear();
+#ifdef LOX_DEFERRED_RC
+    g_heap.process_zct();
+#endif
 }
 
 void VM::repl() {
@@ -56,6 +68,7 @@ InterpretResult VM::interpret(const char *source) {
 
     ObjClosure* closure = create_obj_closure(fn);
     push(Value(closure));
+    Value(closure).stack_adopt();
     call(closure, 0);
 
     return run();
@@ -65,7 +78,10 @@ InterpretResult VM::interpret(const char *source) {
 ObjFunction* VM::compile(const char *source) {
     Parser parser;
     parser.init(source);
-    Compiler compiler(&parser, &m_string_interner);
+    CompilerOptions options;
+    options.register_ops = m_backend == Backend::Register;
+    options.opt_level = m_opt_level;
+    Compiler compiler(&parser, &m_string_interner, &m_globals, &m_compiler_stats, options);
     compiler.init_script();
     compiler.reset_errors();
     return compiler.compile();
@@ -73,9 +89,106 @@ ObjFunction* VM::compile(const char *source) {
 
 void VM::define_native(const char *name, NativeFun function) {
     auto name_str = m_string_interner.create_string(name, (int32_t)strlen(name));
-    Value key = Value(name_str);
-    Value value = Value(create_obj_native_fun(function));
-    m_globals.set(key, value);
+    int32_t slot = m_globals.resolve(name_str);
+    m_globals.values[slot] = Value(create_obj_native_fun(function));
+}
+
+void VM::print_stats() const {
+    uint64_t ic_total = m_stats.ic_hits + m_stats.ic_misses;
+    fflush(stdout);
+    fmt::print(stderr, "---- VM Stats ----\n");
+    fmt::print(stderr, "inline caches: {} hits, {} misses ({:.2f}% hit rate)\n",
+               m_stats.ic_hits, m_stats.ic_misses,
+               ic_total > 0 ? 100.0 * (double)m_stats.ic_hits / (double)ic_total : 0.0);
+    fmt::print(stderr, "bound methods: {} allocated, {} reused\n",
+               m_stats.bound_methods_allocated, m_stats.bound_methods_reused);
+    fmt::print(stderr, "constant folding: {} expressions folded, {} dead branches removed, "
+                       "{} bytes removed after emitting them\n",
+               m_compiler_stats.folded_expressions, m_compiler_stats.dead_branches, m_compiler_stats.folded_bytes);
+    fmt::print(stderr, "bytecode: {} bytes emitted, {} after optimize_chunk\n",
+               m_compiler_stats.emitted_bytes, m_compiler_stats.code_bytes);
+    if (m_opt_level >= OptLevel::O2) {
+        fmt::print(stderr, "ir passes:");
+        for (int32_t i = 0; i < PassCount; i++) {
+            fmt::print(stderr, "{} {} {}", i > 0 ? "," : "", m_compiler_stats.optimizer.changes[i], g_passes[i].name);
+        }
+        fmt::print(stderr, "\n");
+    }
+    fmt::print(stderr, "quickening: {} instructions specialized, {} deopts\n", m_stats.quickenings, m_stats.deopts);
+    for (Obj* obj = g_heap.objects; obj != nullptr; obj = obj->gc_next) {
+        if (obj->type != OBJ_FUNCTION) continue;
+        const ObjFunction* function = Value(obj).as_function();
+        if (function->chunk.m_quickenings == 0 && function->chunk.m_deopts == 0) continue;
+        fmt::print(stderr, "  {}: {} specialized, {} deopts\n",
+                   function->name != nullptr ? function->name->chars : "script",
+                   function->chunk.m_quickenings, function->chunk.m_deopts);
+    }
+    const InternerStats& interner = m_string_interner.stats;
+    fmt::print(stderr, "string interner: {} strings, {} lookups ({:.2f}% hit rate), {} reclaimed, {} short strings\n",
+               m_string_interner.size(), interner.lookups,
+               interner.lookups > 0 ? 100.0 * (double)interner.hits / (double)interner.lookups : 0.0,
+               interner.reclaimed, interner.short_strings);
+    const GCStats& gc = g_heap.stats;
+    fmt::print(stderr, "cycle collector: {} collections, {} objects reclaimed, {} live, "
+                       "pause {:.3f} ms total / {:.3f} ms max\n",
+               gc.collections, gc.objects_reclaimed, g_heap.object_count, gc.total_pause_ms, gc.max_pause_ms);
+#ifdef LOX_DEFERRED_RC
+    fmt::print(stderr, "deferred rc: {} reconciliations, {} objects freed\n",
+               gc.zct_reconciliations, gc.zct_objects_freed);
+#endif
+    const AllocatorStats& alloc = g_allocator.stats;
+    fmt::print(stderr, "allocator: {} bytes live, {} bytes peak, {} bytes in slabs ({:.2f}% fragmentation), "
+                       "{} pooled / {} malloc allocations\n",
+               alloc.total_live_bytes, alloc.peak_live_bytes, alloc.slab_bytes, 100.0 * g_allocator.fragmentation(),
+               alloc.pool_allocations, alloc.malloc_allocations);
+    for (int32_t i = 0; i < ObjTypeCount; i++) {
+        if (alloc.live_count[i] == 0) continue;
+        fmt::print(stderr, "  {}: {} live, {} bytes\n", obj_type_name((ObjType)i), alloc.live_count[i], alloc.live_bytes[i]);
+    }
+}
+
+void VM::set_gc_config(const GCConfig &config) {
+    g_heap.configure(config);
+}
+
+#ifdef LOX_DEFERRED_RC
+void VM::reconcile_stack() {
+    // Pin everything the stack and the active frames point to, free the zero count objects that are left,
+    // then unpin again (which requeues the objects only the stack holds on to).
+    for (Value* slot = m_stack.data(); slot < m_stack_top; slot++) {
+        if (slot->is_obj()) slot->obj_incref();
+    }
+    for (int32_t i = 0; i < m_frame_count; i++) {
+        Value(m_frames[i].closure).obj_incref();
+    }
+    g_heap.process_zct();
+    for (int32_t i = 0; i < m_frame_count; i++) {
+        Value(m_frames[i].closure).obj_decref();
+    }
+    for (Value* slot = m_stack.data(); slot < m_stack_top; slot++) {
+        if (slot->is_obj()) slot->obj_decref();
+    }
+}
+#endif
+
+void VM::collect_garbage() {
+#ifdef LOX_DEFERRED_RC
+    // The sweep frees objects without looking at the zero count table, so nothing unreachable may be left in it.
+    reconcile_stack();
+#endif
+    g_heap.collect([this]() {
+        for (Value* slot = m_stack.data(); slot < m_stack_top; slot++) {
+            g_heap.mark_value(*slot);
+        }
+        for (int32_t i = 0; i < m_frame_count; i++) {
+            g_heap.mark_object(&m_frames[i].closure->obj);
+        }
+        for (ObjUpvalue* upvalue = m_open_upvalues; upvalue != nullptr; upvalue = upvalue->next) {
+            g_heap.mark_object(&upvalue->obj);
+        }
+        m_globals.mark();
+        g_heap.mark_object(&m_init_string->obj);
+    });
 }
 
 void VM::init_builtin_functions() {
@@ -84,14 +197,24 @@ void VM::init_builtin_functions() {
     });
     define_native("print", [](int32_t arg_count, Value* args) {
         if (arg_count == 0) return Value();
-        if (args[0].is_string()) {
-            auto fmt_str = args[0].as_string();
+        if (args[0].is_any_string()) {
+            const char* fmt_str;
+            char short_chars[Value::ShortStringMax + 1];
+            if (args[0].is_short_string()) {
+                int32_t length = args[0].short_string_length();
+                memcpy(short_chars, args[0].short_string_chars(), length);
+                short_chars[length] = 0;
+                fmt_str = short_chars;
+            }
+            else {
+                fmt_str = (args[0].is_rope() ? flatten_rope(args[0].as_rope()) : args[0].as_string())->chars;
+            }
             if (arg_count == 1) {
-                puts(fmt_str->chars);
+                puts(fmt_str);
                 putc('\n', stdout);
             } else {
                 std::string err_msg;
-                if (!formatted_print(stdout, err_msg, fmt_str->chars, Span<Value>(args + 1, arg_count - 1))) {
+                if (!formatted_print(stdout, err_msg, fmt_str, Span<Value>(args + 1, arg_count - 1))) {
                     fmt::print("Format error in print(): {}", err_msg);
                 }
                 putc('\n', stdout);
@@ -103,14 +226,26 @@ void VM::init_builtin_functions() {
         }
         return Value();
     });
+    define_native("has", [](int32_t arg_count, Value* args) {
+        if (arg_count != 2 || !args[0].is_obj() || args[0].obj_type() != OBJ_TABLE) return Value(false);
+        Value value;
+        return Value(args[0].as_table()->get(args[1], &value));
+    });
+    define_native("remove", [](int32_t arg_count, Value* args) {
+        if (arg_count != 2 || !args[0].is_obj() || args[0].obj_type() != OBJ_TABLE) return Value(false);
+        return Value(args[0].as_table()->remove(args[1]));
+    });
 }
 
 InterpretResult VM::run() {
     CallFrame* frame = &m_frames[m_frame_count - 1];
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() (frame->ip += 3, (int32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.m_constants[READ_BYTE()])
-#define READ_STRING() READ_CONSTANT().as_string()
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.m_constants[READ_LONG()])
+#define READ_STRING() READ_CONSTANT_LONG().as_string()
+#define READ_INLINE_CACHE() (&frame->closure->function->chunk.m_inline_caches[READ_SHORT()])
 #define BINARY_OP(op) \
     do {              \
         if (!peek(0).is_number() || !peek(1).is_number()) { \
@@ -121,378 +256,815 @@ InterpretResult VM::run() {
         double a = pop().as_number(); \
         push(Value(a op b)); \
     } while (false);
+// Two unboxed ints skip the doubles. make_int_result is Value for comparisons and Value::int_or_double for
+// arithmetic, which promotes to a double on overflow.
+#define INT_BINARY_OP(op, make_int_result) \
+    do { \
+        if (LOX_LIKELY(peek(0).is_int() && peek(1).is_int())) { \
+            int64_t b = pop().as_int(); \
+            int64_t a = pop().as_int(); \
+            push(make_int_result(a op b)); \
+        } \
+        else BINARY_OP(op) \
+    } while (false);
+#define REGISTER_BINARY_OP(op) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        Value b = read_register(frame, READ_BYTE()); \
+        Value c = read_register(frame, READ_BYTE()); \
+        if (!b.is_number() || !c.is_number()) { \
+            runtime_error("Operands must be numbers."); \
+            return InterpretResult::RuntimeError; \
+        } \
+        write_register(frame, dst, Value(b.as_number() op c.as_number())); \
+    } while (false)
+#define REGISTER_INT_BINARY_OP(op, make_int_result) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        Value b = read_register(frame, READ_BYTE()); \
+        Value c = read_register(frame, READ_BYTE()); \
+        if (LOX_LIKELY(b.is_int() && c.is_int())) { \
+            write_register(frame, dst, make_int_result((int64_t)b.as_int() op (int64_t)c.as_int())); \
+        } \
+        else if (b.is_number() && c.is_number()) { \
+            write_register(frame, dst, Value(b.as_number() op c.as_number())); \
+        } \
+        else { \
+            runtime_error("Operands must be numbers."); \
+            return InterpretResult::RuntimeError; \
+        } \
+    } while (false)
+// Quickening: the first time a generic arithmetic or comparison instruction runs on two ints or two doubles, it
+// rewrites itself in the chunk to its OP_*_INT / OP_*_NUMBER variant, which only checks that the operands still
+// have that type. When they don't, the variant deopts: it puts the generic opcode back and runs that instead,
+// which may quicken the instruction again for the new types.
+#define QUICKEN_BINARY_OP(int_opcode, number_opcode) quicken_binary_op(frame, int_opcode, number_opcode)
+#define DEOPTIMIZE(generic_opcode) \
+    do { \
+        frame->ip[-1] = generic_opcode; \
+        frame->closure->function->chunk.m_deopts++; \
+        m_stats.deopts++; \
+        frame->ip--; \
+        DISPATCH(); \
+    } while (false)
+#define INT_SPECIALIZED_OP(op, make_int_result, generic_opcode) \
+    do { \
+        Value b = peek(0); \
+        Value a = peek(1); \
+        if (!LOX_LIKELY(a.is_int() && b.is_int())) DEOPTIMIZE(generic_opcode); \
+        m_stack_top -= 2; \
+        push(make_int_result((int64_t)a.as_int() op (int64_t)b.as_int())); \
+    } while (false)
+#define NUMBER_SPECIALIZED_OP(op, generic_opcode) \
+    do { \
+        Value b = peek(0); \
+        Value a = peek(1); \
+        if (!LOX_LIKELY(a.is_double() && b.is_double())) DEOPTIMIZE(generic_opcode); \
+        m_stack_top -= 2; \
+        push(Value(a.as_double() op b.as_double())); \
+    } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
     fmt::print("---- Debug Trace ----\n");
+#define TRACE_INSTRUCTION() trace_instruction(frame)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
 #endif
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        fmt::print("          ");
-        for (Value* slot = m_stack.data(); slot < m_stack_top; slot++) {
-            fmt::print("[ ");
-            std::string str = slot->to_std_string(true);
-            fputs(str.c_str(), stdout);
-            fmt::print(" ]");
-        }
-        fmt::print("\n");
-        frame->closure->function->chunk.disassemble_instruction(
-            (int32_t)(frame->ip - frame->closure->function->chunk.m_code.data()));
-        fflush(stdout);
+#ifdef LOX_COMPUTED_GOTO
+    // Direct-threaded dispatch: every handler ends with its own indirect jump,
+    // so the branch predictor can learn opcode-to-opcode transitions.
+    static void* dispatch_table[OP_COUNT] = {
+#define X(val) &&label_##val,
+        OPCODE_LIST(X)
+#undef X
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) label_##name
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (READ_BYTE())
+#define CASE_CODE(name) case name
+#define DISPATCH() goto loop
 #endif
-        uint8_t inst = READ_BYTE();
-        switch (inst) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                if (constant.is_obj()) constant.obj_incref();
-                push(constant);
-                break;
+
+    INTERPRET_LOOP
+    {
+        CASE_CODE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            constant.stack_incref();
+            push(constant);
+            DISPATCH();
+        }
+        CASE_CODE(OP_CONSTANT_LONG): {
+            Value constant = READ_CONSTANT_LONG();
+            constant.stack_incref();
+            push(constant);
+            DISPATCH();
+        }
+        CASE_CODE(OP_NIL): push(Value()); DISPATCH();
+        CASE_CODE(OP_TRUE): push(Value(true)); DISPATCH();
+        CASE_CODE(OP_FALSE): push(Value(false)); DISPATCH();
+        CASE_CODE(OP_POP): {
+            Value value = pop();
+            value.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            auto& val = frame->slots[slot];
+            val.stack_decref();
+            val = peek(0);
+            val.stack_incref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            auto val = frame->slots[slot];
+            push(val);
+            val.stack_incref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = m_globals.values[slot];
+            if (value.is_undefined()) {
+                runtime_error("Undefined variable '{}'.", m_globals.names[slot]->chars);
+                return InterpretResult::RuntimeError;
+            }
+            push(value);
+            value.stack_incref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_DEFINE_GLOBAL): {
+            Value& global = m_globals.values[READ_SHORT()];
+            Value a = pop();
+            a.stack_to_heap();
+            if (global.is_obj()) global.obj_decref();
+            global = a;
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value& global = m_globals.values[slot];
+            if (global.is_undefined()) {
+                runtime_error("Undefined variable '{}'.", m_globals.names[slot]->chars);
+                return InterpretResult::RuntimeError;
             }
-            case OP_NIL: push(Value()); break;
-            case OP_TRUE: push(Value(true)); break;
-            case OP_FALSE: push(Value(false)); break;
-            case OP_POP: {
-                Value value = pop();
+            // The global gets its own reference, the stack keeps the one it had.
+            Value value = peek(0);
+            if (value.is_obj()) value.obj_incref();
+            if (global.is_obj()) global.obj_decref();
+            global = value;
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            Value value = *frame->closure->upvalues[slot]->location;
+            push(value);
+            value.stack_incref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            Value& value = *upvalue->location;
+            if (upvalue->location == &upvalue->closed) {
                 if (value.is_obj()) value.obj_decref();
-                break;
+                value = peek(0);
+                if (value.is_obj()) value.obj_incref();
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                auto& val = frame->slots[slot];
-                if (val.is_obj()) val.obj_decref();
-                val = peek(0);
-                if (val.is_obj()) val.obj_incref();
-                break;
+            else {
+                // Still open, so this writes a stack slot
+                value.stack_decref();
+                value = peek(0);
+                value.stack_incref();
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                auto val = frame->slots[slot];
-                push(val);
-                if (val.is_obj()) val.obj_incref();
-                break;
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            Value superclass_value = pop();
+            ObjClass* superclass = superclass_value.as_class();
+
+            if (!bind_method(superclass, name)) {
+                superclass_value.stack_decref();
+                return InterpretResult::RuntimeError;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                // TODO: create specialized table_string_get() for optimization
-                if (!m_globals.get(Value(name), &value)) {
-                    runtime_error("Undefined variable '{}'.", name->chars);
-                    return InterpretResult::RuntimeError;
-                }
-                push(value);
-                if (value.is_obj()) value.obj_incref();
-                break;
+            superclass_value.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(Value(Value::equals(a, b)));
+            a.stack_decref();
+            b.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_NOT_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(Value(!Value::equals(a, b)));
+            a.stack_decref();
+            b.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_GREATER):
+            QUICKEN_BINARY_OP(OP_GREATER_INT, OP_GREATER_NUMBER);
+            INT_BINARY_OP(>, Value);
+            DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL):
+            QUICKEN_BINARY_OP(OP_GREATER_EQUAL_INT, OP_GREATER_EQUAL_NUMBER);
+            INT_BINARY_OP(>=, Value);
+            DISPATCH();
+        CASE_CODE(OP_LESS):
+            QUICKEN_BINARY_OP(OP_LESS_INT, OP_LESS_NUMBER);
+            INT_BINARY_OP(<, Value)
+            DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL):
+            QUICKEN_BINARY_OP(OP_LESS_EQUAL_INT, OP_LESS_EQUAL_NUMBER);
+            INT_BINARY_OP(<=, Value)
+            DISPATCH();
+        CASE_CODE(OP_ADD): {
+            QUICKEN_BINARY_OP(OP_ADD_INT, OP_ADD_NUMBER);
+            if (LOX_LIKELY(peek(0).is_int() && peek(1).is_int())) {
+                int64_t b = pop().as_int();
+                int64_t a = pop().as_int();
+                push(Value::int_or_double(a + b));
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
+            else if (peek(0).is_any_string() && peek(1).is_any_string()) {
+                Value b = pop();
                 Value a = pop();
-                // TODO: create specialized table_string_set() for optimization
-                m_globals.set(Value(name), a);
-                break;
+                Value result = concatenate(a, b);
+                result.stack_incref();
+                push(result);
+                a.stack_decref();
+                b.stack_decref();
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                // TODO: create specialized table_string_set() for optimization
-                Value name_value = Value(name);
-                if (m_globals.set(name_value, peek(0))) {
-                    m_globals.remove(name_value);
-                    runtime_error("Undefined variable '{}'.", name->chars);
-                    name_value.obj_decref();
-                    return InterpretResult::RuntimeError;
-                }
-                break;
+            else if (peek(0).is_number() && peek(1).is_number()) {
+                double b = pop().as_number();
+                double a = pop().as_number();
+                push(Value(a + b));
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                Value value = *frame->closure->upvalues[slot]->location;
-                push(value);
-                if (value.is_obj()) value.obj_incref();
-                break;
+            else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return InterpretResult::RuntimeError;
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                Value& value = *frame->closure->upvalues[slot]->location;
-                if (value.is_obj()) value.obj_decref();
-                value = peek(0);
-                if (value.is_obj()) value.obj_incref();
-                break;
+            DISPATCH();
+        }
+        CASE_CODE(OP_SUBTRACT):
+            QUICKEN_BINARY_OP(OP_SUBTRACT_INT, OP_SUBTRACT_NUMBER);
+            INT_BINARY_OP(-, Value::int_or_double);
+            DISPATCH();
+        CASE_CODE(OP_MULTIPLY):
+            QUICKEN_BINARY_OP(OP_MULTIPLY_INT, OP_MULTIPLY_NUMBER);
+            BINARY_OP(*);
+            DISPATCH();
+        CASE_CODE(OP_DIVIDE):
+            QUICKEN_BINARY_OP(OP_INVALID, OP_DIVIDE_NUMBER);
+            BINARY_OP(/);
+            DISPATCH();
+        CASE_CODE(OP_ADD_INT): INT_SPECIALIZED_OP(+, Value::int_or_double, OP_ADD); DISPATCH();
+        CASE_CODE(OP_SUBTRACT_INT): INT_SPECIALIZED_OP(-, Value::int_or_double, OP_SUBTRACT); DISPATCH();
+        CASE_CODE(OP_MULTIPLY_INT): {
+            Value b = peek(0);
+            Value a = peek(1);
+            if (!LOX_LIKELY(a.is_int() && b.is_int())) DEOPTIMIZE(OP_MULTIPLY);
+            int64_t product = (int64_t)a.as_int() * (int64_t)b.as_int();
+            m_stack_top -= 2;
+            // Zero times a negative number is -0, which only exists as a double.
+            push(product == 0 && (a.as_int() < 0 || b.as_int() < 0) ? Value(-0.0) : Value::int_or_double(product));
+            DISPATCH();
+        }
+        CASE_CODE(OP_GREATER_INT): INT_SPECIALIZED_OP(>, Value, OP_GREATER); DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL_INT): INT_SPECIALIZED_OP(>=, Value, OP_GREATER_EQUAL); DISPATCH();
+        CASE_CODE(OP_LESS_INT): INT_SPECIALIZED_OP(<, Value, OP_LESS); DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL_INT): INT_SPECIALIZED_OP(<=, Value, OP_LESS_EQUAL); DISPATCH();
+        CASE_CODE(OP_ADD_NUMBER): NUMBER_SPECIALIZED_OP(+, OP_ADD); DISPATCH();
+        CASE_CODE(OP_SUBTRACT_NUMBER): NUMBER_SPECIALIZED_OP(-, OP_SUBTRACT); DISPATCH();
+        CASE_CODE(OP_MULTIPLY_NUMBER): NUMBER_SPECIALIZED_OP(*, OP_MULTIPLY); DISPATCH();
+        CASE_CODE(OP_DIVIDE_NUMBER): NUMBER_SPECIALIZED_OP(/, OP_DIVIDE); DISPATCH();
+        CASE_CODE(OP_GREATER_NUMBER): NUMBER_SPECIALIZED_OP(>, OP_GREATER); DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL_NUMBER): NUMBER_SPECIALIZED_OP(>=, OP_GREATER_EQUAL); DISPATCH();
+        CASE_CODE(OP_LESS_NUMBER): NUMBER_SPECIALIZED_OP(<, OP_LESS); DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL_NUMBER): NUMBER_SPECIALIZED_OP(<=, OP_LESS_EQUAL); DISPATCH();
+        CASE_CODE(OP_NOT): {
+            push(Value(pop().is_falsey()));
+            DISPATCH();
+        }
+        CASE_CODE(OP_NEGATE): {
+            if (!peek(0).is_number()) {
+                runtime_error("Operand must be a number.");
+                return InterpretResult::RuntimeError;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                Value superclass_value = pop();
-                ObjClass* superclass = superclass_value.as_class();
-
-                if (!bind_method(superclass, name)) {
-                    superclass_value.obj_decref();
-                    return InterpretResult::RuntimeError;
-                }
-                superclass_value.obj_decref();
-                break;
+            Value a = pop();
+            // -0 has to be a double
+            if (a.is_int() && a.as_int() != 0) push(Value::int_or_double(-(int64_t)a.as_int()));
+            else push(Value(-a.as_number()));
+            DISPATCH();
+        }
+        CASE_CODE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (peek(0).is_falsey()) frame->ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+#ifdef LOX_DEFERRED_RC
+            if (g_heap.should_reconcile()) reconcile_stack();
+#endif
+            if (g_heap.should_collect()) collect_garbage();
+            DISPATCH();
+        }
+        CASE_CODE(OP_JUMP_LONG): {
+            int32_t offset = READ_LONG();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(OP_JUMP_IF_FALSE_LONG): {
+            int32_t offset = READ_LONG();
+            if (peek(0).is_falsey()) frame->ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(OP_LOOP_LONG): {
+            int32_t offset = READ_LONG();
+            frame->ip -= offset;
+#ifdef LOX_DEFERRED_RC
+            if (g_heap.should_reconcile()) reconcile_stack();
+#endif
+            if (g_heap.should_collect()) collect_garbage();
+            DISPATCH();
+        }
+        CASE_CODE(OP_CALL): {
+#ifdef LOX_DEFERRED_RC
+            if (g_heap.should_reconcile()) reconcile_stack();
+#endif
+            if (g_heap.should_collect()) collect_garbage();
+            int32_t arg_count = READ_BYTE();
+            Value fn_value = peek(arg_count);
+            if (!call_value(fn_value, arg_count)) {
+                return InterpretResult::RuntimeError;
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(Value::equals(a, b)));
-                if (a.is_obj()) a.obj_decref();
-                if (b.is_obj()) b.obj_decref();
-                break;
+            frame = &m_frames[m_frame_count - 1];
+            DISPATCH();
+        }
+        CASE_CODE(OP_INVOKE): {
+            ObjString* method = READ_STRING();
+            int32_t arg_count = READ_BYTE();
+            InlineCache* cache = READ_INLINE_CACHE();
+            if (!invoke(method, arg_count, cache)) {
+                return InterpretResult::RuntimeError;
             }
-            case OP_NOT_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(!Value::equals(a, b)));
-                if (a.is_obj()) a.obj_decref();
-                if (b.is_obj()) b.obj_decref();
-                break;
+            frame = &m_frames[m_frame_count - 1];
+            DISPATCH();
+        }
+        CASE_CODE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int32_t arg_count = READ_BYTE();
+            Value superclass_value = pop();
+            ObjClass* superclass = superclass_value.as_class();
+            if (!invoke_from_class(superclass, method, arg_count)) {
+                superclass_value.stack_decref();
+                return InterpretResult::RuntimeError;
             }
-            case OP_GREATER: BINARY_OP(>); break;
-            case OP_GREATER_EQUAL: BINARY_OP(>=); break;
-            case OP_LESS: BINARY_OP(<) break;
-            case OP_LESS_EQUAL: BINARY_OP(<=) break;
-            case OP_ADD: {
-                if (peek(0).is_string() && peek(1).is_string()) {
-                    Value b = pop();
-                    Value a = pop();
-                    ObjString* str = concat_string(a.as_string(), b.as_string());
-                    ObjString* actual_str = m_string_interner.create_string(str->chars, str->length, str->hash);
-                    if (actual_str != str) free(str);
-                    Value result = Value(actual_str);
-                    result.obj_incref();
-                    push(result);
-                    a.obj_decref();
-                    b.obj_decref();
-                }
-                else if (peek(0).is_number() && peek(1).is_number()) {
-                    double b = pop().as_number();
-                    double a = pop().as_number();
-                    push(Value(a + b));
+            frame = &m_frames[m_frame_count - 1];
+            superclass_value.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_CLOSURE): {
+            ObjFunction* function = READ_CONSTANT_LONG().as_function();
+            ObjClosure* closure = create_obj_closure(function);
+            push(Value(closure));
+            Value(closure).stack_adopt();
+            for (int32_t i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
                 }
                 else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return InterpretResult::RuntimeError;
-                }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(-); break;
-            case OP_MULTIPLY: BINARY_OP(*); break;
-            case OP_DIVIDE: BINARY_OP(/); break;
-            case OP_NOT: {
-                push(Value(pop().is_falsey()));
-                break;
-            }
-            case OP_NEGATE: {
-                if (!peek(0).is_number()) {
-                    runtime_error("Operand must be a number.");
-                    return InterpretResult::RuntimeError;
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                push(Value(-pop().as_number()));
-                break;
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            DISPATCH();
+        }
+        CASE_CODE(OP_CLOSE_UPVALUE): {
+            close_upvalues(m_stack_top - 1);
+            pop();
+            DISPATCH();
+        }
+        CASE_CODE(OP_RETURN): {
+            Value result = pop();
+            close_upvalues(frame->slots);
+            m_frame_count--;
+            if (m_frame_count == 0) {
+                pop();
+                return InterpretResult::Ok;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (peek(0).is_falsey()) frame->ip += offset;
-                break;
+
+            while (m_stack_top != frame->slots) {
+                m_stack_top--;
+                m_stack_top->stack_decref();
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            push(result);
+            frame = &m_frames[m_frame_count - 1];
+            DISPATCH();
+        }
+        CASE_CODE(OP_TABLE_NEW): {
+            ObjTable* table = create_obj_table();
+            push(Value(table));
+            Value(table).stack_adopt();
+            DISPATCH();
+        }
+        CASE_CODE(OP_TABLE_BUILD): {
+            ObjTable* layout = READ_CONSTANT_LONG().as_table();
+            uint8_t count = READ_BYTE();
+            Value* values = m_stack_top - count;
+            for (int32_t i = 0; i < count; i++) {
+                values[i].stack_to_heap();
             }
-            case OP_CALL: {
-                int32_t arg_count = READ_BYTE();
-                Value fn_value = peek(arg_count);
-                if (!call_value(fn_value, arg_count)) {
-                    return InterpretResult::RuntimeError;
-                }
-                frame = &m_frames[m_frame_count - 1];
-                break;
+            ObjTable* table = create_obj_table_from_layout(layout, values, count);
+            m_stack_top = values;
+            push(Value(table));
+            Value(table).stack_adopt();
+            DISPATCH();
+        }
+        CASE_CODE(OP_ARRAY_NEW): {
+            int32_t capacity = READ_LONG();
+            ObjArray* array = create_obj_array();
+            array->reserve(capacity);
+            push(Value(array));
+            Value(array).stack_adopt();
+            DISPATCH();
+        }
+        CASE_CODE(OP_ARRAY_COPY): {
+            ObjArray* array = copy_obj_array(READ_CONSTANT_LONG().as_array());
+            push(Value(array));
+            Value(array).stack_adopt();
+            DISPATCH();
+        }
+        CASE_CODE(OP_ARRAY_APPEND): {
+            uint8_t count = READ_BYTE();
+            Value* elements = m_stack_top - count;
+            for (int32_t i = 0; i < count; i++) {
+                elements[i].stack_to_heap();
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int32_t arg_count = READ_BYTE();
-                if (!invoke(method, arg_count)) {
-                    return InterpretResult::RuntimeError;
-                }
-                frame = &m_frames[m_frame_count - 1];
-                break;
+            elements[-1].as_array()->append(elements, count);
+            m_stack_top = elements;
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET): {
+            Value key = pop();
+            Value obj = pop();
+            // An unboxed index into an array skips VM::get
+            if (key.is_int() && obj.is_array() && (uint32_t)key.as_int() < (uint32_t)obj.as_array()->count) {
+                Value value = obj.as_array()->values[key.as_int()];
+                push(value);
+                value.stack_incref();
+                obj.stack_decref();
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int32_t arg_count = READ_BYTE();
-                Value superclass_value = pop();
-                ObjClass* superclass = superclass_value.as_class();
-                if (!invoke_from_class(superclass, method, arg_count)) {
-                    superclass_value.obj_decref();
-                    return InterpretResult::RuntimeError;
-                }
-                frame = &m_frames[m_frame_count - 1];
-                superclass_value.obj_decref();
-                break;
+            Value value;
+            if (!get(obj, key, &value)) {
+                obj.stack_decref();
+                return InterpretResult::RuntimeError;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = READ_CONSTANT().as_function();
-                ObjClosure* closure = create_obj_closure(function);
-                push(Value(closure));
-                for (int32_t i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    }
-                    else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            obj.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET): {
+            Value value = pop();
+            Value key = pop();
+            Value obj = pop();
+            if (key.is_int() && obj.is_array() && (uint32_t)key.as_int() < (uint32_t)obj.as_array()->count) {
+                Value& element = obj.as_array()->values[key.as_int()];
+                if (element.is_obj()) element.obj_decref();
+                element = value;
+                value.stack_to_heap();
             }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(m_stack_top - 1);
-                pop();
-                break;
+            else if (!set(obj, key, value)) {
+                obj.stack_decref();
+                return InterpretResult::RuntimeError;
             }
-            case OP_RETURN: {
-                Value result = pop();
-                close_upvalues(frame->slots);
-                m_frame_count--;
-                if (m_frame_count == 0) {
-                    pop();
-                    return InterpretResult::Ok;
-                }
-
-                while (m_stack_top != frame->slots) {
-                    m_stack_top--;
-                    if (m_stack_top->is_obj()) m_stack_top->obj_decref();
-                }
-                push(result);
-                frame = &m_frames[m_frame_count - 1];
-                break;
+            push(value);
+            value.stack_incref();
+            obj.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_NOPOP): {
+            Value key = pop();
+            Value obj = peek(0);
+            Value value;
+            if (!get(obj, key, &value)) {
+                return InterpretResult::RuntimeError;
             }
-            case OP_TABLE_NEW: {
-                ObjTable* table = create_obj_table();
-                push(Value(table));
-                break;
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_NOPOP): {
+            Value value = pop();
+            Value key = pop();
+            Value obj = peek(0);
+            if (!set(obj, key, value)) {
+                return InterpretResult::RuntimeError;
             }
-            case OP_ARRAY_NEW: {
-                uint16_t size = READ_SHORT();
-                ObjArray* array = create_obj_array();
-                array->resize(size);
-                push(Value(array));
-                break;
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_PROPERTY): {
+            // TODO: Support property access for tables?
+            if (!peek(0).is_instance()) {
+                runtime_error("Only instances have properties.");
+                return InterpretResult::RuntimeError;
             }
-            case OP_GET: {
-                Value key = pop();
-                Value obj = pop();
-                Value value;
-                if (!get(obj, key, &value)) {
-                    obj.obj_decref();
-                    return InterpretResult::RuntimeError;
-                }
-                obj.obj_decref();
-                break;
+
+            ObjInstance* instance = peek(0).as_instance();
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_INLINE_CACHE();
+
+            int32_t field_index;
+            ObjClosure* method;
+            if (!resolve_property(instance, name, cache, &field_index, &method)) {
+                return InterpretResult::RuntimeError;
             }
-            case OP_SET: {
-                Value value = pop();
-                Value key = pop();
-                Value obj = pop();
-                if (!set(obj, key, value)) {
-                    obj.obj_decref();
-                    return InterpretResult::RuntimeError;
-                }
+
+            if (field_index >= 0) {
+                Value value = instance->fields[field_index];
+                Value inst_value = pop();
                 push(value);
-                if (value.is_obj()) value.obj_incref();
-                obj.obj_decref();
-                break;
-            }
-            case OP_GET_NOPOP: {
-                Value key = pop();
-                Value obj = peek(0);
-                Value value;
-                if (!get(obj, key, &value)) {
-                    return InterpretResult::RuntimeError;
-                }
-                break;
+                value.stack_incref();
+                inst_value.stack_decref();
+                DISPATCH();
             }
-            case OP_SET_NOPOP: {
-                Value value = pop();
-                Value key = pop();
-                Value obj = peek(0);
-                if (!set(obj, key, value)) {
-                    return InterpretResult::RuntimeError;
-                }
-                break;
+
+            bind_method(method, cache);
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_PROPERTY): {
+            // TODO: Support field access for tables?
+            Value inst_value = peek(1);
+            if (!inst_value.is_instance()) {
+                runtime_error("Only instances have properties.");
+                return InterpretResult::RuntimeError;
             }
-            case OP_GET_PROPERTY: {
-                // TODO: Support property access for tables?
-                if (!peek(0).is_instance()) {
-                    runtime_error("Only instances have properties.");
-                    return InterpretResult::RuntimeError;
-                }
 
-                ObjInstance* instance = peek(0).as_instance();
-                ObjString* name = READ_STRING();
-                Value value;
-                if (instance->fields.get(Value(name), &value)) {
-                    Value inst_value = pop();
-                    inst_value.obj_decref();
-                    push(value);
-                    if (value.is_obj()) value.obj_incref();
-                    break;
-                }
+            ObjInstance* instance = inst_value.as_instance();
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_INLINE_CACHE();
 
-                if (!bind_method(instance->klass, name)) {
-                    return InterpretResult::RuntimeError;
-                }
-                break;
+            InlineCacheEntry* entry = cache->find(instance->shape->id);
+            if (entry != nullptr) {
+                m_stats.ic_hits++;
+            }
+            else {
+                m_stats.ic_misses++;
+                int32_t field_index = instance->shape->find_slot(name);
+                Shape* transition = field_index < 0 ? instance->shape->add_transition(name) : nullptr;
+                cache->update(instance->shape->id, field_index, nullptr, transition);
+                entry = cache->find(instance->shape->id);
             }
-            case OP_SET_PROPERTY: {
-                // TODO: Support field access for tables?
-                Value inst_value = peek(1);
-                if (!inst_value.is_instance()) {
-                    runtime_error("Only instances have properties.");
-                    return InterpretResult::RuntimeError;
-                }
 
-                ObjInstance* instance = inst_value.as_instance();
-                instance->fields.set(Value(READ_STRING()), peek(0));
-                Value prop_value = pop();
-                pop();
-                push(prop_value);
-                if (prop_value.is_obj()) prop_value.obj_incref();
-                inst_value.obj_decref();
-                break;
+            Value prop_value = pop();
+            prop_value.stack_to_heap();
+            if (entry->transition != nullptr) {
+                instance_add_field(instance, entry->transition, prop_value);
             }
-            case OP_CLASS: {
-                push(Value(create_obj_class(READ_STRING())));
-                break;
+            else {
+                Value& field = instance->fields[entry->field_index];
+                if (field.is_obj()) field.obj_decref();
+                field = prop_value;
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!superclass.is_class()) {
-                    runtime_error("Superclass must be a class.");
-                    return InterpretResult::RuntimeError;
-                }
-                ObjClass* subclass = peek(0).as_class();
-                ObjTable::add_all(&superclass.as_class()->methods, &subclass->methods);
-                Value subclass_value = pop(); // subclass
-                subclass_value.obj_decref();
-                break;
+            pop();
+            push(prop_value);
+            prop_value.stack_incref();
+            inst_value.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_CLASS): {
+            ObjClass* klass = create_obj_class(READ_STRING());
+            push(Value(klass));
+            Value(klass).stack_adopt();
+            DISPATCH();
+        }
+        CASE_CODE(OP_INHERIT): {
+            Value superclass = peek(1);
+            if (!superclass.is_class()) {
+                runtime_error("Superclass must be a class.");
+                return InterpretResult::RuntimeError;
             }
-            case OP_METHOD: {
-                define_method(READ_STRING());
-                break;
+            ObjClass* subclass = peek(0).as_class();
+            ObjTable::add_all(&superclass.as_class()->methods, &subclass->methods);
+            Value subclass_value = pop(); // subclass
+            subclass_value.stack_decref();
+            DISPATCH();
+        }
+        CASE_CODE(OP_METHOD): {
+            define_method(READ_STRING());
+            DISPATCH();
+        }
+        CASE_CODE(OP_R_MOVE): {
+            uint8_t dst = READ_BYTE();
+            write_register(frame, dst, read_register(frame, READ_BYTE()));
+            DISPATCH();
+        }
+        CASE_CODE(OP_R_EQUAL): {
+            uint8_t dst = READ_BYTE();
+            Value b = read_register(frame, READ_BYTE());
+            Value c = read_register(frame, READ_BYTE());
+            write_register(frame, dst, Value(Value::equals(b, c)));
+            DISPATCH();
+        }
+        CASE_CODE(OP_R_NOT_EQUAL): {
+            uint8_t dst = READ_BYTE();
+            Value b = read_register(frame, READ_BYTE());
+            Value c = read_register(frame, READ_BYTE());
+            write_register(frame, dst, Value(!Value::equals(b, c)));
+            DISPATCH();
+        }
+        CASE_CODE(OP_R_GREATER): REGISTER_INT_BINARY_OP(>, Value); DISPATCH();
+        CASE_CODE(OP_R_GREATER_EQUAL): REGISTER_INT_BINARY_OP(>=, Value); DISPATCH();
+        CASE_CODE(OP_R_LESS): REGISTER_INT_BINARY_OP(<, Value); DISPATCH();
+        CASE_CODE(OP_R_LESS_EQUAL): REGISTER_INT_BINARY_OP(<=, Value); DISPATCH();
+        CASE_CODE(OP_R_ADD): {
+            uint8_t dst = READ_BYTE();
+            Value b = read_register(frame, READ_BYTE());
+            Value c = read_register(frame, READ_BYTE());
+            if (LOX_LIKELY(b.is_int() && c.is_int())) {
+                write_register(frame, dst, Value::int_or_double((int64_t)b.as_int() + c.as_int()));
+            }
+            else if (b.is_number() && c.is_number()) {
+                write_register(frame, dst, Value(b.as_number() + c.as_number()));
+            }
+            else if (b.is_any_string() && c.is_any_string()) {
+                write_register(frame, dst, concatenate(b, c));
+            }
+            else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return InterpretResult::RuntimeError;
+            }
+            DISPATCH();
+        }
+        CASE_CODE(OP_R_SUBTRACT): REGISTER_INT_BINARY_OP(-, Value::int_or_double); DISPATCH();
+        CASE_CODE(OP_R_MULTIPLY): REGISTER_BINARY_OP(*); DISPATCH();
+        CASE_CODE(OP_R_DIVIDE): REGISTER_BINARY_OP(/); DISPATCH();
+        CASE_CODE(OP_ADD_LOCAL_LOCAL): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = frame->slots[READ_BYTE()];
+            if (LOX_LIKELY(a.is_int() && b.is_int())) {
+                push(Value::int_or_double((int64_t)a.as_int() + b.as_int()));
+            }
+            else if (a.is_number() && b.is_number()) {
+                push(Value(a.as_number() + b.as_number()));
+            }
+            else if (a.is_any_string() && b.is_any_string()) {
+                Value result = concatenate(a, b);
+                result.stack_incref();
+                push(result);
+            }
+            else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return InterpretResult::RuntimeError;
+            }
+            DISPATCH();
+        }
+        CASE_CODE(OP_LESS_LOCAL_CONST_JUMP): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (LOX_LIKELY(a.is_int() && b.is_int())) {
+                if (!(a.as_int() < b.as_int())) frame->ip += offset;
+                DISPATCH();
+            }
+            if (!a.is_number() || !b.is_number()) {
+                runtime_error("Operands must be numbers.");
+                return InterpretResult::RuntimeError;
+            }
+            if (!(a.as_number() < b.as_number())) frame->ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(OP_GET_THIS_PROPERTY): {
+            Value receiver = frame->slots[0];
+            if (!receiver.is_instance()) {
+                runtime_error("Only instances have properties.");
+                return InterpretResult::RuntimeError;
+            }
+
+            ObjInstance* instance = receiver.as_instance();
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_INLINE_CACHE();
+
+            int32_t field_index;
+            ObjClosure* method;
+            if (!resolve_property(instance, name, cache, &field_index, &method)) {
+                return InterpretResult::RuntimeError;
+            }
+
+            if (field_index >= 0) {
+                Value value = instance->fields[field_index];
+                push(value);
+                value.stack_incref();
+                DISPATCH();
             }
+
+            push(receiver);
+            receiver.stack_incref();
+            bind_method(method, cache);
+            DISPATCH();
+        }
+        CASE_CODE(OP_INVALID): {
+            runtime_error("Invalid opcode.");
+            return InterpretResult::RuntimeError;
         }
     }
 
+    // Only reachable from the switch fallback on an opcode outside OPCODE_LIST.
+    return InterpretResult::RuntimeError;
+
 #undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef READ_INLINE_CACHE
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef REGISTER_BINARY_OP
+#undef REGISTER_INT_BINARY_OP
+#undef QUICKEN_BINARY_OP
+#undef DEOPTIMIZE
+#undef INT_SPECIALIZED_OP
+#undef NUMBER_SPECIALIZED_OP
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+}
+
+void VM::quicken_binary_op(CallFrame* frame, OpCode int_opcode, OpCode number_opcode) {
+    Chunk& chunk = frame->closure->function->chunk;
+    if (chunk.m_deopts >= QuickenMaxDeopts) return;
+    Value b = peek(0);
+    Value a = peek(1);
+    OpCode opcode;
+    if (a.is_int() && b.is_int() && int_opcode != OP_INVALID) {
+        opcode = int_opcode;
+    }
+    else if (a.is_double() && b.is_double()) {
+        opcode = number_opcode;
+    }
+    else {
+        return;
+    }
+    frame->ip[-1] = opcode;
+    chunk.m_quickenings++;
+    m_stats.quickenings++;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+void VM::trace_instruction(CallFrame* frame) {
+    fmt::print("          ");
+    for (Value* slot = m_stack.data(); slot < m_stack_top; slot++) {
+        fmt::print("[ ");
+        std::string str = slot->to_std_string(true);
+        fputs(str.c_str(), stdout);
+        fmt::print(" ]");
+    }
+    fmt::print("\n");
+    frame->closure->function->chunk.disassemble_instruction(
+        (int32_t)(frame->ip - frame->closure->function->chunk.m_code.data()));
+    fflush(stdout);
+}
+#endif
+
+Value VM::concatenate(Value a, Value b) {
+    const char* a_chars;
+    int32_t a_length;
+    string_contents(a, &a_chars, &a_length);
+    const char* b_chars;
+    int32_t b_length;
+    string_contents(b, &b_chars, &b_length);
+    int32_t length = a_length + b_length;
+    if (a.is_rope() || b.is_rope() || length >= RopeMinLength) {
+        return Value(concat_rope(a, b));
+    }
+    char chars[RopeMinLength];
+    memcpy(chars, a_chars, a_length);
+    memcpy(chars + a_length, b_chars, b_length);
+    return m_string_interner.create_string_value(chars, length);
 }
 
 bool VM::call_value(Value callee, int32_t arg_count) {
@@ -505,16 +1077,20 @@ bool VM::call_value(Value callee, int32_t arg_count) {
                 Value result = native_fn(arg_count, m_stack_top - arg_count);
                 for (int32_t i = 0; i < arg_count + 1; i++) {
                     m_stack_top--;
-                    if (m_stack_top->is_obj()) m_stack_top->obj_decref();
+                    m_stack_top->stack_decref();
                 }
                 push(result);
                 return true;
             }
             case OBJ_CLASS: {
                 ObjClass* klass = callee.as_class();
-                m_stack_top[-arg_count - 1] = Value(create_obj_instance(klass));
+                Value instance = Value(create_obj_instance(klass));
+                instance.stack_adopt();
+                // The instance holds its own reference to the class
+                callee.stack_decref();
+                m_stack_top[-arg_count - 1] = instance;
                 Value initializer;
-                if (klass->methods.get(Value(m_init_string), &initializer)) {
+                if (klass->methods.get_string_key(m_init_string, &initializer)) {
                     return call(initializer.as_closure(), arg_count);
                 }
                 else if (arg_count != 0) {
@@ -525,7 +1101,9 @@ bool VM::call_value(Value callee, int32_t arg_count) {
             }
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = callee.as_bound_method();
+                bound->receiver.stack_incref();
                 m_stack_top[-arg_count - 1] = bound->receiver;
+                callee.stack_decref();
                 return call(bound->method, arg_count);
             }
             default:
@@ -551,7 +1129,7 @@ bool VM::call(ObjClosure* closure, int32_t arg_count) {
     return true;
 }
 
-bool VM::invoke(ObjString *name, int32_t arg_count) {
+bool VM::invoke(ObjString *name, int32_t arg_count, InlineCache* cache) {
     Value receiver = peek(arg_count);
     if (!receiver.is_instance()) {
         runtime_error("Only instances have methods.");
@@ -560,21 +1138,61 @@ bool VM::invoke(ObjString *name, int32_t arg_count) {
 
     ObjInstance* instance = receiver.as_instance();
 
-    Value value;
-    if (instance->fields.get(Value(name), &value)) {
+    int32_t field_index;
+    ObjClosure* method;
+    if (!resolve_property(instance, name, cache, &field_index, &method)) {
+        return false;
+    }
+
+    if (field_index >= 0) {
+        Value value = instance->fields[field_index];
+        value.stack_incref();
         m_stack_top[-arg_count - 1] = value;
+        receiver.stack_decref();
         return call_value(value, arg_count);
     }
-    return invoke_from_class(instance->klass, name, arg_count);
+    return call(method, arg_count);
+}
+
+bool VM::resolve_property(ObjInstance* instance, ObjString* name, InlineCache* cache,
+                          int32_t* field_index, ObjClosure** method) {
+    // The shape fixes both the field layout and the class, so a cached entry answers the whole lookup.
+    InlineCacheEntry* entry = cache->find(instance->shape->id);
+    if (entry != nullptr) {
+        m_stats.ic_hits++;
+        *field_index = entry->field_index;
+        *method = entry->method;
+        return true;
+    }
+
+    m_stats.ic_misses++;
+    *field_index = instance->shape->find_slot(name);
+    *method = nullptr;
+    if (*field_index < 0) {
+        *method = find_method(instance->klass, name);
+        if (*method == nullptr) {
+            return false;
+        }
+    }
+    cache->update(instance->shape->id, *field_index, *method);
+    return true;
 }
 
 bool VM::invoke_from_class(ObjClass *klass, ObjString *name, int32_t arg_count) {
+    ObjClosure* method = find_method(klass, name);
+    if (method == nullptr) {
+        return false;
+    }
+    return call(method, arg_count);
+}
+
+ObjClosure* VM::find_method(ObjClass* klass, ObjString* name) {
     Value method;
-    if (!klass->methods.get(Value(name), &method)) {
+    if (!klass->methods.get_string_key(name, &method)) {
         runtime_error("Undefined property '{}'.", name->chars);
-        return false;
+        return nullptr;
     }
-    return call(method.as_closure(), arg_count);
+    return method.as_closure();
 }
 
 ObjUpvalue *VM::capture_upvalue(Value *local) {
@@ -607,6 +1225,7 @@ void VM::close_upvalues(Value *last) {
            m_open_upvalues->location >= last) {
         ObjUpvalue* upvalue = m_open_upvalues;
         upvalue->closed = *upvalue->location;
+        upvalue->closed.stack_to_heap();
         upvalue->location = &upvalue->closed;
         m_open_upvalues = upvalue->next;
     }
@@ -621,17 +1240,17 @@ bool VM::get(Value obj, Value key, Value* value) {
     if (type == OBJ_ARRAY) {
         if (!key.is_number()) {
             runtime_error("Array index must be a number.");
-            if (key.is_obj()) key.obj_decref();
+            key.stack_decref();
             return false;
         }
-        int32_t index = (int32_t)key.as_number();
+        int32_t index = key.is_int() ? key.as_int() : (int32_t)key.as_number();
         ObjArray* array = obj.as_array();
         if (!array->get(index, value)) {
             runtime_error("Cannot subscript array of count {} with index {}.", array->count, index);
             return false;
         }
         push(*value);
-        if (value->is_obj()) value->obj_incref();
+        value->stack_incref();
     }
     else if (type == OBJ_TABLE) {
         if (!obj.as_table()->get(key, value)) {
@@ -639,8 +1258,8 @@ bool VM::get(Value obj, Value key, Value* value) {
             return false;
         }
         push(*value);
-        if (value->is_obj()) value->obj_incref();
-        if (key.is_obj()) key.obj_decref();
+        value->stack_incref();
+        key.stack_decref();
     }
     return true;
 }
@@ -654,18 +1273,32 @@ bool VM::set(Value obj, Value key, Value value) {
     if (type == OBJ_ARRAY) {
         if (!key.is_number()) {
             runtime_error("Array index must be a number.");
-            if (key.is_obj()) key.obj_decref();
+            key.stack_decref();
             return false;
         }
-        int32_t index = (int32_t)key.as_number();
+        int32_t index = key.is_int() ? key.as_int() : (int32_t)key.as_number();
         ObjArray* array = obj.as_array();
         if (!array->set(index, value)) {
             runtime_error("Cannot subscript array of count {} with index {}.", array->count, index);
             return false;
         }
+        value.stack_to_heap();
     }
     else if (type == OBJ_TABLE) {
-        obj.as_table()->set(key, value);
+        value.stack_to_heap();
+        if (key.is_rope()) {
+            // Keys are always stored flattened, the rope's interned string gets the table's reference
+            Value flat = Value(flatten_rope(key.as_rope()));
+            if (obj.as_table()->set(flat, value)) flat.obj_incref();
+            key.stack_decref();
+        }
+        else if (obj.as_table()->set(key, value)) {
+            key.stack_to_heap();
+        }
+        else {
+            // The table keeps the key it already had
+            key.stack_decref();
+        }
     }
     return true;
 }
@@ -673,27 +1306,55 @@ bool VM::set(Value obj, Value key, Value value) {
 void VM::define_method(ObjString *name) {
     Value method = peek(0);
     ObjClass* klass = peek(1).as_class();
-    Value name_value = Value(name);
-    klass->methods.set(name_value, method);
-    name_value.obj_incref();
+    // The table keeps the name it already had if the method is redefined
+    if (klass->methods.set_string_key(name, method)) Value(name).obj_incref();
     method.obj_incref();
     pop();
 }
 
 bool VM::bind_method(ObjClass *klass, ObjString *name) {
-    Value method;
-    if (!klass->methods.get(Value(name), &method)) {
-        runtime_error("Undefined property '{}'.", name->chars);
+    ObjClosure* method = find_method(klass, name);
+    if (method == nullptr) {
         return false;
     }
-
-    ObjBoundMethod* bound = create_obj_bound_method(peek(0), method.as_closure());
-
-    Value instance_value = pop(); // instance
-    instance_value.obj_decref();
-    push(Value(bound));
+    bind_method(method);
     return true;
 }
 
+void VM::bind_method(ObjClosure* method, [[maybe_unused]] InlineCache* cache) {
+    Value receiver = peek(0);
+#ifndef LOX_DEFERRED_RC
+    // If the bound method this site made last time is only referenced by the cache, nothing can observe it
+    // anymore, so point it at the new receiver instead of allocating another one.
+    // (Stack slots aren't counted with deferred RC, so there the refcount can't tell whether it's still in use.)
+    if (cache != nullptr && cache->bound_method != nullptr && cache->bound_method->obj.refcount == 1) {
+        ObjBoundMethod* bound = cache->bound_method;
+        receiver.obj_incref();
+        bound->receiver.obj_decref();
+        bound->receiver = receiver;
+        bound->method = method;
+        m_stats.bound_methods_reused++;
 
+        Value instance_value = pop(); // instance
+        instance_value.stack_decref();
+        push(Value(bound));
+        Value(bound).stack_incref();
+        return;
+    }
+#endif
+
+    ObjBoundMethod* bound = create_obj_bound_method(receiver, method);
+    m_stats.bound_methods_allocated++;
+#ifndef LOX_DEFERRED_RC
+    if (cache != nullptr) {
+        if (cache->bound_method != nullptr) Value(cache->bound_method).obj_decref();
+        cache->bound_method = bound;
+        Value(bound).obj_incref();
+    }
+#endif
 
+    Value instance_value = pop(); // instance
+    instance_value.stack_decref();
+    push(Value(bound));
+    Value(bound).stack_adopt();
+}
@@ -2,6 +2,23 @@
 #include "vm/value.h"
 #include "vm/string.h"
 #include "vm/string_interner.h"
+#include "vm/globals.h"
+#include "vm/gc.h"
+
+struct VMStats {
+    uint64_t ic_hits = 0;
+    uint64_t ic_misses = 0;
+    uint64_t bound_methods_allocated = 0;
+    uint64_t bound_methods_reused = 0;
+    uint64_t quickenings = 0;
+    uint64_t deopts = 0;
+};
+
+// Which instruction set the compiler emits, see OP_R_* in vm/opcode.h.
+enum class Backend {
+    Stack,
+    Register
+};
 
 struct CallFrame {
     ObjClosure* closure;
@@ -24,11 +41,33 @@ public:
 
     void define_native(const char* name, NativeFun function);
 
+    const VMStats& stats() const { return m_stats; }
+
+    void set_gc_config(const GCConfig& config);
+
+    void set_backend(Backend backend) { m_backend = backend; }
+
+    void set_opt_level(OptLevel level) { m_opt_level = level; }
+
+    // Runs the cycle collector over everything reachable from the VM.
+    void collect_garbage();
+
+#ifdef LOX_DEFERRED_RC
+    // Frees the objects in the zero count table that the stack doesn't point to.
+    void reconcile_stack();
+#endif
+
+    void print_stats() const;
+
 private:
     void init_builtin_functions();
 
     InterpretResult run();
 
+#ifdef DEBUG_TRACE_EXECUTION
+    void trace_instruction(CallFrame* frame);
+#endif
+
     void reset_stack() {
         m_stack_top = m_stack.data();
         m_frame_count = 0;
@@ -48,10 +87,43 @@ private:
         return m_stack_top[-1 - distance];
     }
 
+    static Value read_register(CallFrame* frame, uint8_t rk) {
+        if (rk & RKConstantBit) {
+            return frame->closure->function->chunk.m_constants[rk & ~RKConstantBit];
+        }
+        return frame->slots[rk];
+    }
+
+    void write_register(CallFrame* frame, uint8_t reg, Value value) {
+        value.stack_incref();
+        if (reg == RegisterPush) {
+            push(value);
+        }
+        else {
+            Value& slot = frame->slots[reg];
+            slot.stack_decref();
+            slot = value;
+        }
+    }
+
+    // A function stops quickening once it has deopted this many times, so polymorphic sites settle on the
+    // generic opcodes instead of being rewritten back and forth.
+    static constexpr int32_t QuickenMaxDeopts = 64;
+
+    // Rewrites the binary instruction that was just read to int_opcode if both operands are ints, or to
+    // number_opcode if both are doubles. int_opcode is OP_INVALID for operations without an int variant.
+    void quicken_binary_op(CallFrame* frame, OpCode int_opcode, OpCode number_opcode);
+
+    // Returns an unowned string, or a rope if the result is at least RopeMinLength long.
+    Value concatenate(Value a, Value b);
+
     bool call_value(Value callee, int32_t arg_count);
     bool call(ObjClosure* closure, int32_t arg_count);
-    bool invoke(ObjString* name, int32_t arg_count);
+    bool invoke(ObjString* name, int32_t arg_count, InlineCache* cache);
     bool invoke_from_class(ObjClass* klass, ObjString* name, int32_t arg_count);
+    ObjClosure* find_method(ObjClass* klass, ObjString* name);
+    bool resolve_property(ObjInstance* instance, ObjString* name, InlineCache* cache,
+                          int32_t* field_index, ObjClosure** method);
 
     ObjUpvalue* capture_upvalue(Value* local);
     void close_upvalues(Value* last);
@@ -61,6 +133,7 @@ private:
 
     void define_method(ObjString* name);
     bool bind_method(ObjClass* klass, ObjString* name);
+    void bind_method(ObjClosure* method, InlineCache* cache = nullptr);
 
     template <typename ...Args>
     inline void runtime_error(const char* fmt, Args&&... args) {
@@ -98,9 +171,14 @@ private:
     Value* m_stack_top = nullptr;
 
     StringInterner m_string_interner;
-    ObjTable m_globals;
+    GlobalTable m_globals;
 
     ObjUpvalue* m_open_upvalues = nullptr;
 
     ObjString* m_init_string;
+
+    VMStats m_stats;
+    CompilerStats m_compiler_stats;
+    Backend m_backend = Backend::Stack;
+    OptLevel m_opt_level = OptLevel::O1;
 };